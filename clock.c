@@ -1,5 +1,5 @@
 /* 
- * clock.c - Routines for using the cycle counters on x86, 
+ * clock.c - Routines for using the cycle counters on x86 (32 and 64-bit), 
  *           Alpha, and Sparc boxes.
  * 
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
@@ -10,66 +10,72 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/times.h>
+#include <time.h>
 #include "clock.h"
 
 
 /******************************************************* 
  * Machine dependent functions 
  *
- * Note: the constants __i386__ and  __alpha
+ * Note: the constants __i386__, __x86_64__ and __alpha
  * are set by GCC when it calls the C preprocessor
  * You can verify this for yourself using gcc -v.
  *******************************************************/
 
-#if defined(__i386__)  
+#if defined(__i386__) || defined(__x86_64__)
 /*******************************************************
- * Pentium versions of start_counter() and get_counter()
+ * x86 versions of start_counter() and get_counter()
+ *
+ * The time stamp counter is read with the reads fenced, so
+ * that the instructions timed can neither start before the
+ * first read nor retire after the last one. The last read
+ * uses rdtscp, which waits for the instructions before it,
+ * where the CPU has it.
  *******************************************************/
+#include <cpuid.h>
 
+#define RDTSCP_BIT (1 << 27)  /* in edx of cpuid leaf 0x80000001 */
 
-/* $begin x86cyclecounter */
 /* Initialize the cycle counter */
-static unsigned cyc_hi = 0;
-static unsigned cyc_lo = 0;
+static unsigned long long cyc_start = 0;
+static int has_rdtscp = -1;  /* unknown until the first start_counter */
 
+/* Read the counter once every instruction before has completed */
+static inline unsigned long long counter_begin(void)
+{
+    unsigned hi, lo;
 
-/* Set *hi and *lo to the high and low order bits  of the cycle counter.  
-   Implementation requires assembly code to use the rdtsc instruction. */
-void access_counter(unsigned *hi, unsigned *lo)
+    asm volatile("lfence; rdtsc; lfence" : "=a" (lo), "=d" (hi) :: "memory");
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* Read the counter before any instruction after has started */
+static inline unsigned long long counter_end(void)
 {
-    asm("rdtsc; movl %%edx,%0; movl %%eax,%1"   /* Read cycle counter */
-	: "=r" (*hi), "=r" (*lo)                /* and move results to */
-	: /* No input */                        /* the two outputs */
-	: "%edx", "%eax");
+    unsigned hi, lo, aux;
+
+    if (!has_rdtscp)
+	return counter_begin();
+    asm volatile("rdtscp; lfence" : "=a" (lo), "=d" (hi), "=c" (aux) :: "memory");
+    return ((unsigned long long)hi << 32) | lo;
 }
 
 /* Record the current value of the cycle counter. */
 void start_counter()
 {
-    access_counter(&cyc_hi, &cyc_lo);
+    unsigned eax, ebx, ecx, edx;
+
+    if (has_rdtscp < 0)
+	has_rdtscp = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+	    (edx & RDTSCP_BIT) != 0;
+    cyc_start = counter_begin();
 }
 
 /* Return the number of cycles since the last call to start_counter. */
 double get_counter()
 {
-    unsigned ncyc_hi, ncyc_lo;
-    unsigned hi, lo, borrow;
-    double result;
-
-    /* Get cycle counter */
-    access_counter(&ncyc_hi, &ncyc_lo);
-
-    /* Do double precision subtraction */
-    lo = ncyc_lo - cyc_lo;
-    borrow = lo > ncyc_lo;
-    hi = ncyc_hi - cyc_hi - borrow;
-    result = (double) hi * (1 << 30) * 4 + lo;
-    if (result < 0) {
-	fprintf(stderr, "Error: counter returns neg value: %.0f\n", result);
-    }
-    return result;
+    return (double)(counter_end() - cyc_start);
 }
-/* $end x86cyclecounter */
 
 #elif defined(__alpha)
 
@@ -163,6 +169,31 @@ double get_counter()
 
 
 
+/*
+ * read_counter - Return the raw value of the cycle counter, for timing
+ * intervals too short for start_counter/get_counter. On platforms without
+ * a counter we know how to read, it counts nanoseconds instead.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+unsigned long long read_counter()
+{
+    unsigned hi, lo;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+#else
+unsigned long long read_counter()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+
+
 /*******************************
  * Machine-independent functions
  ******************************/
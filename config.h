@@ -58,13 +58,129 @@
  */
 #define ALIGNMENT 8  
 
+/*
+ * Set to 1 to back the heap with memory reserved from the system with
+ * mmap instead of the simulated heap, as the drop-in malloc library
+ * libmm.so does. It can also be set with -DMM_SYSTEM=1.
+ */
+#ifndef MM_SYSTEM
+#define MM_SYSTEM 0
+#endif
+
+/*
+ * Set to 1 when the package is built into libmm.so, as the Makefile
+ * does, rather than linked with mdriver.
+ */
+#ifndef MM_PRELOAD
+#define MM_PRELOAD 0
+#endif
+
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. Below 2 GB, mm.c uses 4-byte headers
+ * and links; from 2 GB on, 8-byte ones. It can also be set with
+ * -DMAX_HEAP=n; use a long constant for heaps of 2 GB or more.
  */
+#ifndef MAX_HEAP
+#if MM_SYSTEM
+#define MAX_HEAP (1<<30)       /* 1 GB of address space */
+#else
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
+#endif
+
+/*
+ * Memory the malloc package gives back. Once the free block at the top
+ * of the heap reaches TRIM_THRESHOLD bytes, the heap shrinks to leave
+ * MALLOCBUF of it; the interior pages of any other free block of at
+ * least RELEASE_THRESHOLD bytes are released. Either can be set from
+ * the command line; 0 turns it off.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128*(1<<10))  /* 128 KB */
+#endif
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD (1<<20)     /* 1 MB */
+#endif
+
+/*
+ * Deferred coalescing. A freed block of a size that malloc hands out
+ * for requests of at most QUICK_MAX bytes, whose neighbours are both
+ * allocated, stays allocated on a quick list of that size instead of
+ * being coalesced, and the next request of the size takes it back.
+ * The quick lists are coalesced in one pass when a request finds no
+ * free block, before realloc moves a block, or once they hold
+ * QUICK_LIMIT bytes. QUICK_MAX must be below 4 KB; 0 turns it off.
+ * Either can be set from the command line.
+ */
+#ifndef QUICK_MAX
+#define QUICK_MAX 2048
+#endif
+#ifndef QUICK_LIMIT
+#define QUICK_LIMIT (64*(1<<10))  /* 64 KB */
+#endif
+
+/*
+ * Requests of at least MMAP_THRESHOLD bytes get a mapping of their own
+ * outside the heap, which free unmaps and realloc resizes with mremap.
+ * 0 turns it off. It is only on by default in libmm.so; mdriver leaves
+ * it off, so that its scores measure the heap alone, unless it is set
+ * from the command line. mdriver then accepts blocks that lie within a
+ * live mapping, which memlib records, and counts the mapped bytes in
+ * the heap size it measures utilization against.
+ */
+#ifndef MMAP_THRESHOLD
+#if MM_PRELOAD
+#define MMAP_THRESHOLD (128*(1<<10))  /* 128 KB */
+#else
+#define MMAP_THRESHOLD 0
+#endif
+#endif
+
+/*
+ * A block of at least REMAP_THRESHOLD bytes that realloc has to move
+ * is placed at the same offset within a page as before, so that its
+ * whole pages are moved by remapping them rather than copied. Only the
+ * system heap can remap; 0 turns it off.
+ */
+#ifndef REMAP_THRESHOLD
+#if MM_SYSTEM
+#define REMAP_THRESHOLD (64*(1<<10))  /* 64 KB */
+#else
+#define REMAP_THRESHOLD 0
+#endif
+#endif
+
+/*
+ * Set to 1 to make the malloc package thread-safe: the heap is guarded
+ * by a lock, and each thread caches the small blocks it frees. It can
+ * also be set from the command line with -DMM_THREADS=1.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+/*
+ * Number of independent arenas the thread-safe malloc package creates;
+ * threads are bound to them round-robin. More than one requires
+ * MM_THREADS. It can also be set with -DMM_ARENAS=n.
+ */
+#ifndef MM_ARENAS
+#define MM_ARENAS 1
+#endif
+
+/*
+ * Set to 1 to count the work the malloc package does (searches, list
+ * walks, splits, coalesces and heap growth) for mm_heap_stats and the
+ * -S timeline of the driver. Off, the counting compiles to nothing. It
+ * can also be set from the command line with -DMM_STATS=1.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
 
 /*****************************************************************************
- * Set exactly one of these USE_xxx constants to "1" to select a timing method
+ * Set exactly one of these USE_xxx constants to "1" to select a timing method.
+ * mdriver -F warm|cold uses the cycle counter whatever is selected here.
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
@@ -8,6 +8,7 @@
  * the time in CPU cycles for a function f.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 #include <stdio.h>
 
@@ -30,6 +31,7 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static test_funct flush = NULL;   /* flushes the data of the test function */
 
 static int *cache_buf = NULL;
 
@@ -98,11 +100,12 @@ static int has_converged()
 }
 
 /* 
- * clear - Code to clear cache 
+ * clear - Code to clear cache: flush the data of the test function, if
+ *     there is a flush function, then read a buffer of cache_bytes
  */
 static volatile int sink = 0;
 
-static void clear()
+static void clear(void *argp)
 {
     int x = sink;
     int *cptr, *cend;
@@ -113,7 +116,11 @@ static void clear()
 	    fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
 	    exit(1);
 	}
+	/* pages never written would all read the same zero page */
+	memset(cache_buf, 1, cache_bytes);
     }
+    if (flush)
+	flush(argp);
     cptr = (int *) cache_buf;
     cend = cptr + cache_bytes/sizeof(int);
     while (cptr < cend) {
@@ -123,6 +130,23 @@ static void clear()
     sink = x;
 }
 
+/*
+ * flush_cache - Write back and evict the cache lines of bytes from start
+ *     from every level of cache. Only x86 has an instruction to do so;
+ *     elsewhere, it does nothing.
+ */
+void flush_cache(void *start, size_t bytes)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    char *p = (char *)((unsigned long)start & ~(unsigned long)(cache_block - 1));
+    char *end = (char *)start + bytes;
+
+    for (; p < end; p += cache_block)
+	asm volatile("clflush %0" : "+m" (*p));
+    asm volatile("mfence" ::: "memory");
+#endif
+}
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
@@ -134,7 +158,7 @@ double fcyc(test_funct f, void *argp)
 	do {
 	    double cyc;
 	    if (clear_cache)
-		clear();
+		clear(argp);
 	    start_comp_counter();
 	    f(argp);
 	    cyc = get_comp_counter();
@@ -144,7 +168,7 @@ double fcyc(test_funct f, void *argp)
 	do {
 	    double cyc;
 	    if (clear_cache)
-		clear();
+		clear(argp);
 	    start_counter();
 	    f(argp);
 	    cyc = get_counter();
@@ -206,6 +230,17 @@ void set_fcyc_cache_block(int bytes) {
 }
 
 
+/* 
+ * set_fcyc_flush - When set, along with clear_cache, flush(argp) is
+ *     called before each measurement to flush the data the test
+ *     function argp works on, before the buffer is read.
+ *     Default = NULL
+ */
+void set_fcyc_flush(test_funct flush_arg)
+{
+    flush = flush_arg;
+}
+
 /* 
  * set_fcyc_compensate- When set, will attempt to compensate for 
  *     timer interrupt overhead 
@@ -13,6 +13,9 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* Evict bytes from start from every level of cache (x86 only) */
+void flush_cache(void *start, size_t bytes);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -36,6 +39,14 @@ void set_fcyc_cache_size(int bytes);
  */
 void set_fcyc_cache_block(int bytes);
 
+/* 
+ * set_fcyc_flush - When set, along with clear_cache, flush(argp) is
+ *     called before each measurement to flush the data the test
+ *     function argp works on, before the buffer is read.
+ *     Default = NULL
+ */
+void set_fcyc_flush(test_funct flush_arg);
+
 /* 
  * set_fcyc_compensate- When set, will attempt to compensate for 
  *     timer interrupt overhead 
@@ -1,7 +1,10 @@
 /****************************
  * High-level timing wrappers
  ****************************/
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
@@ -9,16 +12,64 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static int method = FSECS_CONFIG;  /* way of timing chosen by init_fsecs */
+#ifdef __linux__
+static int pinned_cpu = -1;  /* CPU the cycle counter runs are pinned to */
+static cpu_set_t saved_cpus; /* CPUs the driver may run on otherwise */
+#endif
+
+static void pin_cpu(int pin);
 
 extern int verbose; /* -v option in mdriver.c */
 
 /*
- * init_fsecs - initialize the timing package
+ * init_fsecs - initialize the timing package. FSECS_WARM and FSECS_COLD
+ *     time with the K-best cycle counter whatever config.h selects, on
+ *     the CPU the driver runs on now; for FSECS_COLD, flush(argp) is
+ *     called to evict the data of the test function before each run.
  */
-void init_fsecs(void)
+void init_fsecs(int method_arg, fsecs_test_funct flush)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
+    method = method_arg;
+    if (method != FSECS_CONFIG) {
+#ifdef __linux__
+	pinned_cpu = sched_getcpu();
+#endif
+	set_fcyc_maxsamples(20);
+	set_fcyc_compensate(0);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	set_fcyc_clear_cache(method == FSECS_COLD);
+	set_fcyc_flush(flush);
+
+	/*
+	 * flush evicts the data of the run from every cache; sweeping
+	 * twice the L2 cache evicts the rest from the private caches
+	 */
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	if (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+	    set_fcyc_cache_size(2 * sysconf(_SC_LEVEL2_CACHE_SIZE));
+	if (sysconf(_SC_LEVEL1_DCACHE_LINESIZE) > 0)
+	    set_fcyc_cache_block(sysconf(_SC_LEVEL1_DCACHE_LINESIZE));
+#endif
+	if (verbose) {
+	    printf("Measuring performance with a cycle counter, %s",
+		   (method == FSECS_COLD) ? "flushing the caches before each run"
+		   : "with warm caches");
+#ifdef __linux__
+	    if (pinned_cpu >= 0)
+		printf(", on CPU %d", pinned_cpu);
+#endif
+	    printf(".\n");
+	}
+	pin_cpu(1);
+	Mhz = mhz(verbose > 0);
+	pin_cpu(0);
+	return;
+    }
+
 #if USE_FCYC
     if (verbose)
 	printf("Measuring performance with a cycle counter.\n");
@@ -44,8 +95,16 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
+    double cycles;
+
+    if (method != FSECS_CONFIG) {
+	pin_cpu(1);
+	cycles = fcyc(f, argp);
+	pin_cpu(0);
+	return cycles/(Mhz*1e6);
+    }
 #if USE_FCYC
-    double cycles = fcyc(f, argp);
+    cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
 #elif USE_ITIMER
     return ftimer_itimer(f, argp, 10);
@@ -54,4 +113,27 @@ double fsecs(fsecs_test_funct f, void *argp)
 #endif 
 }
 
+/*
+ * pin_cpu - Bind the driver to the CPU chosen by init_fsecs if pin is
+ *     set, so that every sample runs on the same core and its caches,
+ *     and give it back the CPUs it had before otherwise. Threads the
+ *     driver starts later (-j) are not pinned.
+ */
+static void pin_cpu(int pin)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
 
+    if (pinned_cpu < 0)
+	return;
+    if (pin) {
+	if (sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) < 0)
+	    return;
+	CPU_ZERO(&cpus);
+	CPU_SET(pinned_cpu, &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+    else
+	sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+#endif
+}
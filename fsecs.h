@@ -1,4 +1,9 @@
 typedef void (*fsecs_test_funct)(void *);
 
-void init_fsecs(void);
+/* Ways of timing, for init_fsecs */
+#define FSECS_CONFIG 0  /* the timer selected in config.h */
+#define FSECS_WARM   1  /* cycle counter, with the caches warm from the run before */
+#define FSECS_COLD   2  /* cycle counter, with the data of the run flushed first */
+
+void init_fsecs(int method, fsecs_test_funct flush);
 double fsecs(fsecs_test_funct f, void *argp);
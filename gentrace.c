@@ -0,0 +1,425 @@
+/*
+ * gentrace.c - Generate synthetic traces from parametric distributions
+ *
+ * Usage: gentrace [-b] [-n <ops>] [-l <bytes>] [-s <dist>]... [-t <dist>]...
+ *                 [-r <pct>] [-g <growth>] [-j <n>] [-S <seed>] <out>
+ *
+ * Blocks get sizes drawn from -s, and lifetimes drawn from -t that are
+ * counted in allocations. The clock advances by one with every
+ * allocation; a block is freed as soon as its lifetime has run out.
+ * Once the payload of the live blocks reaches the live-set target -l
+ * (1 MB unless given), the clock jumps to the next death instead, so the
+ * live set stays at the target with the shortest-lived blocks going
+ * first; lifetimes long against the allocations the target holds, such
+ * as -t exp:1e9, leave the live set to the target alone. With -r, that
+ * percentage of the allocations reallocs a random live block instead,
+ * to its size grown as -g says: mul:<factor> (mul:2 unless given) or
+ * add:<bytes>. The last requests free every block still live, and the
+ * trace has -n requests (100000 unless given) in all, or one less if
+ * the last would have been a malloc.
+ *
+ * A distribution is one of
+ *
+ *     fixed:<n>  uniform:<lo>:<hi>  loguniform:<lo>:<hi>  pow2:<lo>:<hi>
+ *     exp:<mean>
+ *
+ * where pow2 draws powers of two between lo and hi, all alike likely.
+ * Sizes default to loguniform:16:4096 and lifetimes to exp:1000. If -s
+ * or -t is given more than once, the trace is cut into as many phases
+ * of equal length, and each phase draws from the next one of them.
+ *
+ * The trace is written in .rep format, or in the binary format with -b
+ * (see trace.h); block ids are the lowest not held by a live block, as
+ * rep2bin makes them. With -j, n traces <out>.0 to <out>.n-1 are made
+ * from seeds -S (1 unless given) on, for one thread each of
+ *
+ *     mdriver -j <n> -f <out>.0 ... -f <out>.n-1 [-x]
+ *
+ * which hands the blocks of each thread to another for freeing with -x.
+ * The simulated heap must hold the live set: build mdriver with a
+ * larger -DMAX_HEAP for large targets, and use -b for long traces,
+ * which mdriver maps rather than reads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MAXLINE    1024      /* max string size */
+#define MAX_SPECS  16        /* most -s or -t distributions */
+#define SIZE_LIMIT (1 << 30) /* largest request, also after growing */
+
+/* Kinds of distributions */
+enum {FIXED, UNIFORM, LOGUNIFORM, POW2, EXP};
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+    int kind;
+    double a, b;  /* the value, bounds or mean, as given */
+} dist_t;
+
+/* The parameters of the traces */
+static dist_t sizes[MAX_SPECS], lifetimes[MAX_SPECS];
+static int nsizes = 0, nlifetimes = 0;
+static long long live_target = 1 << 20;  /* bytes of payload live at most (-l) */
+static double realloc_pct = 0;           /* allocations that are reallocs (-r) */
+static int grow_add = 0;                 /* if set, -g adds bytes... */
+static double grow_by = 2;               /* ... else multiplies by this */
+static unsigned long long seed;          /* state of the generator */
+
+/* The blocks of a trace, indexed by id */
+static int *block_size;   /* payload size of each live block */
+static long *block_death; /* clock at which each live block is freed */
+static int *live_pos;     /* position of each live block in live */
+static int *live;         /* ids of the live blocks, in no order */
+static int nlive = 0;
+static int *deaths;       /* ids of the live blocks, as a heap by death */
+static int *freeids;      /* ids not in use, as a stack... */
+static int nfree = 0;     /* ... of that many ids */
+static int next_id = 0;   /* lowest id never used so far */
+static int max_ids = 0;   /* ids that fit in the arrays */
+
+static void gen_trace(char *name, int binary, unsigned ops_total);
+static int parse_dist(char *spec, dist_t *dist);
+static double draw(dist_t *dist);
+static double uniform(void);
+static int clamp_size(double size);
+static int new_block(int size, long death);
+static void free_block(int id);
+static void sift_down(int i);
+static void put_op(FILE *out, int binary, int type, int index, int size);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    char name[MAXLINE];
+    unsigned ops = 100000;
+    int binary = 0, njobs = 1, c, i;
+    unsigned long long first_seed = 1;
+
+    while ((c = getopt(argc, argv, "bn:l:s:t:r:g:j:S:")) != EOF) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+	case 'n':
+	    ops = strtoul(optarg, NULL, 0);
+	    break;
+	case 'l':
+	    live_target = strtoll(optarg, NULL, 0);
+	    break;
+	case 's':
+	    if (nsizes == MAX_SPECS || !parse_dist(optarg, &sizes[nsizes++]))
+		app_error("Bad size distribution");
+	    break;
+	case 't':
+	    if (nlifetimes == MAX_SPECS || !parse_dist(optarg, &lifetimes[nlifetimes++]))
+		app_error("Bad lifetime distribution");
+	    break;
+	case 'r':
+	    realloc_pct = atof(optarg);
+	    break;
+	case 'g':
+	    if (sscanf(optarg, "mul:%lf", &grow_by) == 1 && grow_by > 0)
+		grow_add = 0;
+	    else if (sscanf(optarg, "add:%lf", &grow_by) == 1)
+		grow_add = 1;
+	    else
+		app_error("Bad growth");
+	    break;
+	case 'j':
+	    njobs = atoi(optarg);
+	    break;
+	case 'S':
+	    first_seed = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || ops < 2 || live_target <= 0 || njobs < 1 ||
+	realloc_pct < 0 || realloc_pct > 100)
+	usage();
+    if (nsizes == 0)
+	parse_dist("loguniform:16:4096", &sizes[nsizes++]);
+    if (nlifetimes == 0)
+	parse_dist("exp:1000", &lifetimes[nlifetimes++]);
+
+    for (i = 0; i < njobs; i++) {
+	if (njobs == 1)
+	    snprintf(name, sizeof(name), "%s", argv[optind]);
+	else
+	    snprintf(name, sizeof(name), "%s.%d", argv[optind], i);
+	seed = (first_seed + i) ^ 0x9E3779B97F4A7C15ULL; /* never 0 in practice */
+	gen_trace(name, binary, ops);
+    }
+    exit(0);
+}
+
+/*
+ * gen_trace - Write a trace of ops_total requests to the file name
+ */
+static void gen_trace(char *name, int binary, unsigned ops_total)
+{
+    FILE *out;
+    trace_header_t header;
+    unsigned ops = 0;
+    int phase, nphases, id, size, max_live = 0;
+    long clock = 0;
+    long long live_bytes = 0, max_bytes = 0;
+
+    if ((out = fopen(name, "wb")) == NULL)
+	app_error("Could not open output trace");
+
+    /* the header is written again once the number of ids is known */
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.sugg_heapsize = 0;
+    header.num_ids = 0;
+    header.num_ops = 0;
+    header.weight = 1;
+    if (binary)
+	fwrite(&header, sizeof(header), 1, out);
+    else
+	fprintf(out, "%d\n%10d\n%10d\n%d\n", 0, 0, 0, 1);
+
+    nphases = (nsizes > nlifetimes) ? nsizes : nlifetimes;
+    nlive = nfree = next_id = 0;
+
+    /* every block allocated needs a request to free it in the end */
+    while (ops + nlive < ops_total) {
+	phase = (int)((double)ops * nphases / ops_total);
+	if ((nlive == 0 || (block_death[deaths[0]] > clock && live_bytes < live_target)) &&
+	    ops + nlive + 2 <= ops_total) {
+	    if (nlive > 0 && uniform() * 100 < realloc_pct) {
+		id = live[(int)(uniform() * nlive)];
+		size = clamp_size(grow_add ? block_size[id] + grow_by
+				  : block_size[id] * grow_by);
+		live_bytes += size - block_size[id];
+		block_size[id] = size;
+		put_op(out, binary, REALLOC, id, size);
+	    }
+	    else {
+		size = clamp_size(draw(&sizes[phase % nsizes]));
+		id = new_block(size, clock + 1 +
+			       (long)draw(&lifetimes[phase % nlifetimes]));
+		live_bytes += size;
+		clock++;
+		put_op(out, binary, ALLOC, id, size);
+	    }
+	    max_live = (nlive > max_live) ? nlive : max_live;
+	    max_bytes = (live_bytes > max_bytes) ? live_bytes : max_bytes;
+	}
+	else if (nlive == 0)
+	    break; /* one request left, with no block to free */
+	else {
+	    /* free the block due first; if the live set is full, skip to its death */
+	    id = deaths[0];
+	    if (block_death[id] > clock)
+		clock = block_death[id];
+	    live_bytes -= block_size[id];
+	    free_block(id);
+	    put_op(out, binary, FREE, id, 0);
+	}
+	ops++;
+    }
+
+    /* free the blocks still live, in the order they would die */
+    while (nlive > 0) {
+	id = deaths[0];
+	free_block(id);
+	put_op(out, binary, FREE, id, 0);
+	ops++;
+    }
+
+    /* fill in the header */
+    header.num_ids = next_id;
+    header.num_ops = ops;
+    rewind(out);
+    if (binary)
+	fwrite(&header, sizeof(header), 1, out);
+    else
+	fprintf(out, "%d\n%10d\n%10d\n%d\n", 0, next_id, ops, 1);
+    if (ferror(out) || fclose(out) != 0)
+	app_error("Write error");
+    printf("%s: %u requests on %d ids, at most %d blocks and %lld bytes live\n",
+	   name, ops, next_id, max_live, max_bytes);
+}
+
+/*
+ * parse_dist - Read a distribution as given on the command line.
+ *     Returns 0 if it is not one.
+ */
+static int parse_dist(char *spec, dist_t *dist)
+{
+    char kind[MAXLINE];
+    int n;
+
+    dist->a = dist->b = 0;
+    n = sscanf(spec, "%[a-z2]:%lf:%lf", kind, &dist->a, &dist->b);
+    if (n == 2 && !strcmp(kind, "fixed"))
+	dist->kind = FIXED;
+    else if (n == 2 && !strcmp(kind, "exp"))
+	dist->kind = EXP;
+    else if (n == 3 && !strcmp(kind, "uniform"))
+	dist->kind = UNIFORM;
+    else if (n == 3 && !strcmp(kind, "loguniform"))
+	dist->kind = LOGUNIFORM;
+    else if (n == 3 && !strcmp(kind, "pow2"))
+	dist->kind = POW2;
+    else
+	return 0;
+    if (dist->a < 0 || (n == 3 && (dist->b < dist->a || dist->a < 1)) ||
+	(dist->kind == POW2 && floor(log2(dist->b)) < ceil(log2(dist->a))))
+	return 0;
+    return 1;
+}
+
+/*
+ * draw - Draw a value from a distribution
+ */
+static double draw(dist_t *dist)
+{
+    switch (dist->kind) {
+    case FIXED:
+	return dist->a;
+    case UNIFORM:
+	return dist->a + uniform() * (dist->b - dist->a + 1);
+    case LOGUNIFORM:
+	return exp(log(dist->a) + uniform() * (log(dist->b + 1) - log(dist->a)));
+    case POW2:
+	return ldexp(1, (int)ceil(log2(dist->a)) +
+		     (int)(uniform() * (floor(log2(dist->b)) - ceil(log2(dist->a)) + 1)));
+    default:
+	return -dist->a * log(1 - uniform());
+    }
+}
+
+/*
+ * clamp_size - Returns a request size between 1 and SIZE_LIMIT
+ */
+static int clamp_size(double size)
+{
+    return (size < 1) ? 1 : (size > SIZE_LIMIT) ? SIZE_LIMIT : (int)size;
+}
+
+/*
+ * uniform - Returns a random number in [0, 1), from a xorshift64*
+ *     generator
+ */
+static double uniform(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return ((seed * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * new_block - Take the lowest free id for a block of size bytes that
+ *     dies at clock death, and return it
+ */
+static int new_block(int size, long death)
+{
+    int id, i, parent;
+
+    if (nfree > 0)
+	id = freeids[--nfree];
+    else {
+	if (next_id == max_ids) {
+	    max_ids = 2 * max_ids + 1024;
+	    if ((block_size = (int *)realloc(block_size, max_ids * sizeof(int))) == NULL ||
+		(block_death = (long *)realloc(block_death, max_ids * sizeof(long))) == NULL ||
+		(live_pos = (int *)realloc(live_pos, max_ids * sizeof(int))) == NULL ||
+		(live = (int *)realloc(live, max_ids * sizeof(int))) == NULL ||
+		(deaths = (int *)realloc(deaths, max_ids * sizeof(int))) == NULL ||
+		(freeids = (int *)realloc(freeids, max_ids * sizeof(int))) == NULL)
+		app_error("Out of memory");
+	}
+	id = next_id++;
+    }
+    block_size[id] = size;
+    block_death[id] = death;
+    live_pos[id] = nlive;
+    live[nlive] = id;
+
+    /* sift the block up the heap of deaths */
+    for (i = nlive++; i > 0 && block_death[deaths[parent = (i - 1) / 2]] > death; i = parent)
+	deaths[i] = deaths[parent];
+    deaths[i] = id;
+    return id;
+}
+
+/*
+ * free_block - Free the block that dies first, id, and make its id free
+ */
+static void free_block(int id)
+{
+    nlive--;
+    live[live_pos[id]] = live[nlive];
+    live_pos[live[nlive]] = live_pos[id];
+    deaths[0] = deaths[nlive];
+    sift_down(0);
+    freeids[nfree++] = id;
+}
+
+/*
+ * sift_down - Move the block at position i of the heap of deaths down
+ *     to where it dies no later than the blocks below it
+ */
+static void sift_down(int i)
+{
+    int id = deaths[i], child;
+
+    while ((child = 2 * i + 1) < nlive) {
+	if (child + 1 < nlive && block_death[deaths[child + 1]] < block_death[deaths[child]])
+	    child++;
+	if (block_death[deaths[child]] >= block_death[id])
+	    break;
+	deaths[i] = deaths[child];
+	i = child;
+    }
+    deaths[i] = id;
+}
+
+/*
+ * put_op - Write a request in .rep or binary format
+ */
+static void put_op(FILE *out, int binary, int type, int index, int size)
+{
+    traceop_t op;
+
+    if (binary) {
+	op.type = type;
+	op.index = index;
+	op.size = size;
+	fwrite(&op, sizeof(op), 1, out);
+    }
+    else if (type == FREE)
+	fprintf(out, "f %d\n", index);
+    else
+	fprintf(out, "%c %d %d\n", (type == ALLOC) ? 'a' : 'r', index, size);
+}
+
+/*
+ * usage - Print the command line and exit
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-b] [-n <ops>] [-l <bytes>] [-s <dist>]... [-t <dist>]...\n"
+	    "                [-r <pct>] [-g <growth>] [-j <n>] [-S <seed>] <out>\n");
+    exit(1);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "gentrace: %s\n", msg);
+    exit(1);
+}
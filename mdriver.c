@@ -15,11 +15,21 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
+#include "clock.h"
+#include "perfctr.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -29,6 +39,17 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define HANDOFF_BATCH 64 /* blocks handed to another thread at once (-x) */
+#define HANDOFF_MAX 1024 /* blocks a thread may have waiting to be freed (-x) */
+#define JOB_RUNS       3 /* best of JOB_RUNS wall times is reported (-j) */
+#define GROUP_RUNS     3 /* best of GROUP_RUNS timings of each replay (-G) */
+#define RANGE_CHUNK 1024 /* range records allocated at once by the pool */
+#define REPORT_JSON    1 /* -o json */
+#define REPORT_CSV     2 /* -o csv */
+#define BASELINE_TOLERANCE 0.10 /* default drop that counts as regression */
+#define HIST_SUB_BITS  4 /* log2 of latency buckets per power of two (-L) */
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS   ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS) /* to 2^64 */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,20 +58,15 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* payloads below lo (next free record in pool) */
+    struct range_t *right; /* payloads above hi */
+    unsigned prio;         /* random priority, larger than its children */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +76,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace that holds ops... */
+    size_t map_size;     /* ... and its length; NULL and 0 for text traces */
 } trace_t;
 
 /* 
@@ -70,8 +88,36 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    int *group_ends; /* end of the batch each request starts (-G) */
 } speed_t;
 
+/* Holds the state of one replay thread in multi-threaded mode (-j) */
+typedef struct job_t {
+    pthread_t tid;          /* thread replaying the trace */
+    trace_t *trace;         /* private copy of the trace it replays */
+    char *tracefile;        /* name of that trace */
+    struct job_t *peer;     /* thread that frees our blocks (-x) */
+    pthread_mutex_t lock;   /* guards the handoff array */
+    char **handoff;         /* blocks other threads handed us to free... */
+    int nhandoff;           /* ... how many there are... */
+    int maxhandoff;         /* ... and how many fit in the array */
+    double start;           /* when this thread started its trace... */
+    double end;             /* ... and when it was done with it */
+    double secs;            /* time this thread needed in the best run */
+} job_t;
+
+/* Counts the latencies of one request type on one trace (-L) */
+typedef struct {
+    unsigned long count[HIST_BUCKETS]; /* latencies in each bucket */
+    unsigned long n;                   /* latencies counted */
+    unsigned long long max;            /* largest latency counted */
+} hist_t;
+
+/* Holds the latency histograms of one trace, one per request type */
+typedef struct {
+    hist_t op[3];  /* indexed by the type of a traceop_t */
+} latency_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +127,7 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double heap;     /* heap size in bytes at the end of the trace */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -92,9 +139,22 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* Parameters shared by all replay threads in multi-threaded mode (-j) */
+static pthread_barrier_t job_start;  /* releases all threads at once */
+static int job_busy;                 /* threads still replaying their trace */
+static int job_cross = 0;            /* if set, blocks are freed by peers */
+static unsigned long long lat_ovhd;  /* cycles of reading the counter (-L) */
+static int sample_every = 0;         /* requests between heap samples (-S) */
+static int check_step = 0;           /* if set, check the heap after each request (-c) */
+static int group_max = 0;            /* most requests replayed as one batch (-G) */
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Range records that are not in use, linked by their left pointers */
+static range_t *range_pool = NULL;
+static unsigned range_seed = 1;      /* state of the priority generator */
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -110,9 +170,15 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *root, range_t *node);
+static range_t *range_delete(range_t *root, char *lo);
+static range_t *range_merge(range_t *left, range_t *right);
+static range_t *range_alloc(void);
+static void range_release(range_t *root);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(char *path, trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -124,6 +190,48 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void flush_speed(void *ptr);
+
+/* Routines for replaying traces on several threads at once (-j) */
+static void eval_mm_jobs(char **tracefiles, int num_tracefiles, int njobs);
+static double run_mm_jobs(job_t *jobs, int njobs);
+static void *job_thread(void *ptr);
+static void hand_off(job_t *job, job_t *peer, char **blocks, int n);
+static void free_handed_off(job_t *job);
+static double job_clock(void);
+
+/* Routines for timing every request (-L) */
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static unsigned long long counter_ovhd(void);
+static void hist_add(hist_t *hist, unsigned long long cycles);
+static unsigned long long hist_percentile(hist_t *hist, double q);
+static void printlatency(int n, latency_t *lats);
+
+/* Routines for counting hardware events of the speed runs (-P) */
+static void printperf(int n, stats_t *stats, perf_counts_t *perfs);
+
+/* Routines for sampling the shape of the heap over a trace (-S) */
+static void print_sample_header(int tracenum);
+static void print_sample(int opnum, int live, mm_stats_t *last);
+static void print_heap_totals(mm_stats_t *stats);
+
+/* Routines for replaying like requests as batches (-G) */
+static void eval_mm_groups(char **tracefiles, int num_tracefiles,
+			   stats_t *stats);
+static int *group_trace(trace_t *trace, int limit, int *groups);
+static int replay_grouped(trace_t *trace, int *ends, int tracenum,
+			  range_t **ranges);
+static void eval_mm_grouped_speed(void *ptr);
+
+/* Routines for machine-readable output (-o, --baseline) */
+static void write_report(FILE *fp, int format, char **tracefiles, int n,
+			 stats_t *stats, latency_t *lats, perf_counts_t *perfs,
+			 double perfindex);
+static void json_string(FILE *fp, char *s);
+static int json_unescape(char *p, char *s, size_t size);
+static int json_number(char *line, char *key, double *val);
+static int compare_baseline(char *filename, char **tracefiles, int n,
+			    stats_t *stats, double tolerance);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -145,11 +253,28 @@ int main(int argc, char **argv)
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    latency_t *mm_lats = NULL; /* mm latency histograms for each trace */
+    perf_counts_t *mm_perfs = NULL; /* mm hardware events for each trace */
+    speed_t speed_params = {NULL, NULL, NULL}; /* input parameters to the xx_speed routines */
 
    // int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int njobs = 0;       /* If set, replay traces on this many threads (-j) */
+    int latency = 0;     /* If set, time every request (-L) */
+    int perf = 0;        /* If set, count hardware events of speed runs (-P) */
+    int timing = FSECS_CONFIG; /* cycle counter with warm or cold caches (-F) */
+    int format = 0;      /* If set, write a report in this format (-o) */
+    FILE *report = NULL; /* where that report goes: the original stdout */
+    char *baseline = NULL;  /* If set, compare with this report (-b) */
+    double tolerance = BASELINE_TOLERANCE; /* regression threshold */
+    int regressions = 0;
+    static struct option long_options[] = {
+	{"baseline", required_argument, NULL, 'b'},
+	{"output", required_argument, NULL, 'o'},
+	{"threshold", required_argument, NULL, 'T'},
+	{NULL, 0, NULL, 0}
+    };
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,21 +283,22 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt_long(argc, argv, "f:t:hvVgalj:xLPF:o:b:S:cG:",
+			    long_options, NULL)) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
-        case 'f': /* Use one specific trace file only (relative to curr dir) */
-            num_tracefiles = 1;
-            if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+        case 'f': /* Use specific trace files only (relative to curr dir) */
+            if ((tracefiles = realloc(tracefiles,
+				      (num_tracefiles+2)*sizeof(char *))) == NULL)
 		unix_error("ERROR: realloc failed in main");
 	    strcpy(tracedir, "./"); 
-            tracefiles[0] = strdup(optarg);
-            tracefiles[1] = NULL;
+            tracefiles[num_tracefiles++] = strdup(optarg);
+            tracefiles[num_tracefiles] = NULL;
             break;
 	case 't': /* Directory where the traces are located */
-	    if (num_tracefiles == 1) /* ignore if -f already encountered */
+	    if (num_tracefiles > 0) /* ignore if -f already encountered */
 		break;
 	    strcpy(tracedir, optarg);
 	    if (tracedir[strlen(tracedir)-1] != '/') 
@@ -184,6 +310,62 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'j': /* Replay traces on several threads at once */
+            if ((njobs = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'x': /* Hand blocks to another thread for freeing */
+            job_cross = 1;
+            break;
+        case 'L': /* Time every request and print latency percentiles */
+            latency = 1;
+            break;
+        case 'P': /* Count hardware events of every mm speed run */
+            perf = 1;
+            break;
+        case 'F': /* Time with the cycle counter, caches warm or cold */
+	    if (!strcmp(optarg, "warm"))
+		timing = FSECS_WARM;
+	    else if (!strcmp(optarg, "cold"))
+		timing = FSECS_COLD;
+	    else {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'S': /* Print a timeline of the heap shape every n requests */
+            if ((sample_every = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'c': /* Check a slice of the heap after every request */
+            check_step = 1;
+            break;
+        case 'G': /* Replay like requests in a row as batches */
+            if ((group_max = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'o': /* Write the results in a machine-readable format */
+	    if (!strcmp(optarg, "json"))
+		format = REPORT_JSON;
+	    else if (!strcmp(optarg, "csv"))
+		format = REPORT_CSV;
+	    else {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'b': /* Compare the results with an earlier JSON report */
+            baseline = strdup(optarg);
+            break;
+        case 'T': /* Drop in util or throughput that counts as regression */
+            tolerance = atof(optarg) / 100.0;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -226,6 +408,17 @@ int main(int argc, char **argv)
 	    printf("Member 2 :%s:%s\n", team.name2, team.id2);
     }*/
 
+    /*
+     * If a report is written, it gets stdout to itself, and everything
+     * else is printed on stderr
+     */
+    if (format) {
+	fflush(stdout);
+	if ((report = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+	    unix_error("fdopen failed in main");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -237,7 +430,9 @@ int main(int argc, char **argv)
     }
 
     /* Initialize the timing package */
-    init_fsecs();
+    init_fsecs(timing, flush_speed);
+    if (perf && init_perf() == 0)
+	printf("No hardware events can be counted: %s\n", strerror(errno));
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -284,6 +479,13 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (latency &&
+	(mm_lats = (latency_t *)calloc(num_tracefiles, sizeof(latency_t))) == NULL)
+	unix_error("mm_lats calloc in main failed");
+    if (perf &&
+	(mm_perfs = (perf_counts_t *)calloc(num_tracefiles,
+					    sizeof(perf_counts_t))) == NULL)
+	unix_error("mm_perfs calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
@@ -299,11 +501,16 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].heap = mem_heap_peak();
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (perf)
+		fperf(eval_mm_speed, &speed_params, &mm_perfs[i]);
+	    if (latency)
+		eval_mm_latency(trace, &mm_lats[i]);
 	}
 	free_trace(trace);
     }
@@ -314,6 +521,14 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (latency && errors == 0) {
+	printlatency(num_tracefiles, mm_lats);
+	printf("\n");
+    }
+    if (perf && errors == 0) {
+	printperf(num_tracefiles, mm_stats, mm_perfs);
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -358,32 +573,60 @@ int main(int argc, char **argv)
 	printf("Terminated with %d errors\n", errors);
     }
 
+    /*
+     * Optionally replay the traces on several threads at once
+     */
+    if (njobs > 0 && errors == 0)
+	eval_mm_jobs(tracefiles, num_tracefiles, njobs);
+
+    /*
+     * Optionally replay the traces with like requests grouped in batches
+     */
+    if (group_max > 0 && errors == 0)
+	eval_mm_groups(tracefiles, num_tracefiles, mm_stats);
+
+    /*
+     * Optionally write a report, and compare with an earlier one
+     */
+    if (format) {
+	write_report(report, format, tracefiles, num_tracefiles, mm_stats,
+		     mm_lats, mm_perfs, perfindex);
+	fclose(report);
+    }
+    if (baseline != NULL && errors == 0)
+	regressions = compare_baseline(baseline, tracefiles, num_tracefiles,
+				       mm_stats, tolerance);
+
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
     }
 
-    exit(0);
+    exit(regressions > 0 ? 2 : 0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range set, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks. The set is
+ * a treap ordered by payload address: a binary search tree whose
+ * random priorities keep it balanced in expectation, so that each
+ * request is checked in O(log n) time. Range records come from a
+ * pool and are never returned to libc.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range set. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *q;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -396,36 +639,45 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within */
+    /* one of the mappings the package made with mem_map             */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Since those
+     * don't overlap each other, it is enough to check the one that
+     * starts last at or below hi.
+     */
+    for (p = *ranges, q = NULL;  p != NULL; ) {
+	if (p->lo <= hi) {
+	    q = p;
+	    p = p->right;
+	}
+	else
+	    p = p->left;
+    }
+    if (q != NULL && q->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, q->lo, q->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range set.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = range_alloc();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -434,34 +686,130 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = range_delete(*ranges, lo);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges)
+{
+    range_release(*ranges);
+    *ranges = NULL;
+}
+
+/*
+ * range_insert - Insert node into the treap at root, and return the new
+ *     root. The node is added as a leaf, and rotated up while its
+ *     priority is larger than the one of its parent.
+ */
+static range_t *range_insert(range_t *root, range_t *node)
+{
+    range_t *child;
+
+    if (root == NULL)
+	return node;
+    if (node->lo < root->lo) {
+	child = root->left = range_insert(root->left, node);
+	if (child->prio > root->prio) {
+	    root->left = child->right;
+	    child->right = root;
+	    return child;
+	}
+    }
+    else {
+	child = root->right = range_insert(root->right, node);
+	if (child->prio > root->prio) {
+	    root->right = child->left;
+	    child->left = root;
+	    return child;
+	}
+    }
+    return root;
+}
+
+/*
+ * range_delete - Remove the record of the payload at lo from the treap
+ *     at root, if there is one, and return the new root
+ */
+static range_t *range_delete(range_t *root, char *lo)
+{
+    range_t *node;
+
+    if (root == NULL)
+	return NULL;
+    if (lo < root->lo)
+	root->left = range_delete(root->left, lo);
+    else if (lo > root->lo)
+	root->right = range_delete(root->right, lo);
+    else {
+	node = root;
+	root = range_merge(node->left, node->right);
+	node->left = range_pool;
+	range_pool = node;
+    }
+    return root;
+}
+
+/*
+ * range_merge - Join two treaps, all of whose payloads in left are below
+ *     the ones in right, and return the root of the result
+ */
+static range_t *range_merge(range_t *left, range_t *right)
+{
+    if (left == NULL)
+	return right;
+    if (right == NULL)
+	return left;
+    if (left->prio > right->prio) {
+	left->right = range_merge(left->right, right);
+	return left;
+    }
+    right->left = range_merge(left, right->left);
+    return right;
+}
+
+/*
+ * range_alloc - Take a range record from the pool, refilling the pool
+ *     with RANGE_CHUNK records at once when it is empty, and give it a
+ *     random priority
+ */
+static range_t *range_alloc(void)
 {
     range_t *p;
-    range_t *pnext;
+    int i;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in range_alloc");
+	for (i = 0; i < RANGE_CHUNK; i++) {
+	    p[i].left = range_pool;
+	    range_pool = &p[i];
+	}
     }
-    *ranges = NULL;
+    p = range_pool;
+    range_pool = p->left;
+
+    /* xorshift generator */
+    range_seed ^= range_seed << 13;
+    range_seed ^= range_seed >> 17;
+    range_seed ^= range_seed << 5;
+    p->prio = range_seed;
+    p->left = p->right = NULL;
+    return p;
+}
+
+/*
+ * range_release - Return every record of the treap at root to the pool
+ */
+static void range_release(range_t *root)
+{
+    if (root == NULL)
+	return;
+    range_release(root->left);
+    range_release(root->right);
+    root->left = range_pool;
+    range_pool = root;
 }
 
 
@@ -489,22 +837,63 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* A binary trace is mapped, and its requests are used in place */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (!map_trace(path, trace)) {
+	/* Read the trace file header */
+	if ((tracefile = fopen(path, "r")) == NULL) {
+	    sprintf(msg, "Could not open %s in read_trace", path);
+	    unix_error(msg);
+	}
+	fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%d", &(trace->num_ids));     
+	fscanf(tracefile, "%d", &(trace->num_ops));     
+	fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+	trace->map = NULL;
+	trace->map_size = 0;
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops = 
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+
+	/* read every request line in the trace file */
+	index = 0;
+	op_index = 0;
+	while (fscanf(tracefile, "%s", type) != EOF) {
+	    switch(type[0]) {
+	    case 'a':
+		fscanf(tracefile, "%u %u", &index, &size);
+		trace->ops[op_index].type = ALLOC;
+		trace->ops[op_index].index = index;
+		trace->ops[op_index].size = size;
+		max_index = (index > max_index) ? index : max_index;
+		break;
+	    case 'r':
+		fscanf(tracefile, "%u %u", &index, &size);
+		trace->ops[op_index].type = REALLOC;
+		trace->ops[op_index].index = index;
+		trace->ops[op_index].size = size;
+		max_index = (index > max_index) ? index : max_index;
+		break;
+	    case 'f':
+		fscanf(tracefile, "%ud", &index);
+		trace->ops[op_index].type = FREE;
+		trace->ops[op_index].index = index;
+		break;
+	    default:
+		printf("Bogus type character (%c) in tracefile %s\n", 
+		       type[0], path);
+		exit(1);
+	    }
+	    op_index++;
+	
+	}
+	fclose(tracefile);
+	assert(max_index == trace->num_ids - 1);
+	assert(trace->num_ops == op_index);
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -516,43 +905,66 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
     
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
+    return trace;
+}
+
+/*
+ * map_trace - If the file at path is a binary trace, map it into memory,
+ *     point the requests of trace into the mapping, and return 1.
+ *     Return 0 if it is not a binary trace. Exits if a request names a
+ *     block id outside the num_ids of the header, or has no valid type.
+ */
+static int map_trace(char *path, trace_t *trace)
+{
+    int fd, i;
+    struct stat st;
+    trace_header_t header;
+    traceop_t *ops;
+    size_t size;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+	close(fd);
+	return 0;
+    }
+    if (header.version != TRACE_VERSION || header.num_ids < 0 ||
+	header.num_ops < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Unsupported binary trace %s", path);
+	app_error(msg);
+    }
+    size = sizeof(header) + (size_t)header.num_ops * sizeof(traceop_t);
+    if ((size_t)st.st_size < size) {
+	sprintf(msg, "Binary trace %s is truncated", path);
+	app_error(msg);
+    }
+
+    /* the requests are read front to back, once here and once a run */
+    if ((trace->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	unix_error("mmap failed in read_trace");
+    madvise(trace->map, size, MADV_SEQUENTIAL);
+    close(fd);
+
+    /* the blocks arrays have num_ids entries, which every request must stay within */
+    ops = (traceop_t *)((char *)trace->map + sizeof(header));
+    for (i = 0; i < header.num_ops; i++) {
+	if (ops[i].index < 0 || ops[i].index >= header.num_ids ||
+	    (ops[i].type != ALLOC && ops[i].type != FREE && ops[i].type != REALLOC)) {
+	    sprintf(msg, "Bad request %d in binary trace %s", i, path);
+	    app_error(msg);
 	}
-	op_index++;
-	
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
-    return trace;
+
+    trace->map_size = size;
+    trace->sugg_heapsize = header.sugg_heapsize;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->weight = header.weight;
+    trace->ops = ops;
+    return 1;
 }
 
 /*
@@ -561,7 +973,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* free the three arrays... */
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -573,7 +988,9 @@ void free_trace(trace_t *trace)
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the mm malloc package for correctness. Even
+ *     requests use mm_malloc and mm_free, odd ones mm_malloc_usable
+ *     and mm_free_sized, so that every trace exercises both.
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
@@ -581,6 +998,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     int index;
     int size;
     int oldsize;
+    size_t usable;
     char *newp;
     char *oldp;
     char *p;
@@ -602,13 +1020,22 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC: /* mm_malloc or mm_malloc_usable */
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    /* Call the student's malloc, and check the usable size it reports */
+	    p = (i & 1) ? mm_malloc_usable(size, &usable) : mm_malloc(size);
+	    if (p == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
+	    if ((i & 1) && (usable < size || usable != mm_usable_size(p))) {
+		malloc_error(tracenum, i, "mm_malloc_usable reported a wrong usable size.");
+		return 0;
+	    }
+	    if (!(i & 1) && mm_usable_size(p) < size) {
+		malloc_error(tracenum, i, "mm_usable_size is below the size of mm_malloc.");
+		return 0;
+	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
@@ -639,6 +1066,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
+	    if (mm_usable_size(newp) < size) {
+		malloc_error(tracenum, i, "mm_usable_size is below the size of mm_realloc.");
+		return 0;
+	    }
+
 	    /* Remove the old region from the range list */
 	    remove_range(ranges, oldp);
 	    
@@ -654,7 +1086,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -667,18 +1099,27 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
-        case FREE: /* mm_free */
+        case FREE: /* mm_free or mm_free_sized */
 	    
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    if (i & 1)
+		mm_free_sized(p, trace->block_sizes[index]);
+	    else
+		mm_free(p);
 	    break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Check a slice of the heap and the block just returned (-c) */
+	if (check_step && 
+	    !mm_check_step(trace->ops[i].type == FREE ? NULL : trace->blocks[index])) {
+	    malloc_error(tracenum, i, "mm_check_step found the heap inconsistent.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -690,10 +1131,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   high water mark of the heap in bytes while running the student's
+ *   malloc package on the trace. mem_sbrk() lets the package shrink
+ *   the heap, so its size at the end may be smaller. Blocks the
+ *   package maps outside the heap with mem_map count too, by the
+ *   largest heap plus mapped size seen after any request.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -705,11 +1147,19 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    mm_stats_t sample;
+    size_t mapped, footprint, max_footprint = 0;
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package; mappings that are */
+    /* still live were left behind by earlier passes                    */
     mem_reset_brk();
+    mapped = mem_mapsize();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    if (sample_every) {
+	print_sample_header(tracenum);
+	mm_heap_stats(&sample);
+    }
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -773,9 +1223,21 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	footprint = mem_heapsize() + (mem_mapsize() - mapped);
+	max_footprint = (footprint > max_footprint) ? footprint : max_footprint;
+
+	/* Sample the heap every sample_every requests, and after the last */
+	if (sample_every && 
+	    ((i + 1) % sample_every == 0 || i == trace->num_ops - 1))
+	    print_sample(i + 1, total_size, &sample);
     }
+    if (sample_every)
+	print_heap_totals(&sample);
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    footprint = mem_heap_peak();
+    max_footprint = (footprint > max_footprint) ? footprint : max_footprint;
+    return ((double)max_total_size / (double)max_footprint);
 }
 
 
@@ -826,6 +1288,23 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * flush_speed - Evict the heap of the last run and the trace that the
+ *    timed function is about to replay from the caches (-F cold)
+ */
+static void flush_speed(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+    trace_t *trace = params->trace;
+
+    flush_cache(mem_heap_lo(), mem_heap_peak());
+    flush_cache(trace->ops, trace->num_ops * sizeof(traceop_t));
+    flush_cache(trace->blocks, trace->num_ids * sizeof(char *));
+    flush_cache(trace->block_sizes, trace->num_ids * sizeof(size_t));
+    if (params->group_ends != NULL)
+	flush_cache(params->group_ends, trace->num_ops * sizeof(int));
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -911,6 +1390,921 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*********************************************************************
+ * The following functions replay traces on several threads at once,
+ * against a single instance of the mm malloc package. They require a
+ * package built with MM_THREADS.
+ *********************************************************************/
+
+/*
+ * eval_mm_jobs - Replay njobs traces at once, each on its own thread.
+ *     Thread i replays trace i modulo the number of traces, so a single
+ *     trace is replayed as njobs copies. Prints the time and latency of
+ *     every thread, the aggregate throughput, and the scaling efficiency
+ *     relative to one thread replaying the first trace alone.
+ */
+static void eval_mm_jobs(char **tracefiles, int num_tracefiles, int njobs)
+{
+    int i;
+    double ops, secs, base_ops, base_secs;
+    job_t *jobs;
+
+    if (njobs > 1 && !MM_THREADS)
+	app_error("-j requires an mm package built with MM_THREADS");
+
+    if ((jobs = (job_t *)calloc(njobs, sizeof(job_t))) == NULL)
+	unix_error("jobs calloc in eval_mm_jobs failed");
+    for (i = 0; i < njobs; i++) {
+	jobs[i].tracefile = tracefiles[i % num_tracefiles];
+	jobs[i].trace = read_trace(tracedir, jobs[i].tracefile);
+	jobs[i].peer = &jobs[(i + 1) % njobs];
+	pthread_mutex_init(&jobs[i].lock, NULL);
+    }
+
+    /* first, the baseline of a single thread */
+    if (verbose > 1)
+	printf("\nReplaying %s on 1 thread\n", jobs[0].tracefile);
+    jobs[0].peer = &jobs[0];
+    base_secs = run_mm_jobs(jobs, 1);
+    base_ops = jobs[0].trace->num_ops;
+    jobs[0].peer = &jobs[1 % njobs];
+
+    /* then, all threads at once */
+    if (verbose > 1)
+	printf("Replaying %d traces on %d threads\n", njobs, njobs);
+    secs = run_mm_jobs(jobs, njobs);
+
+    printf("\nResults for mm malloc on %d thread%s%s:\n", njobs, njobs > 1 ? "s" : "",
+	   job_cross ? " (cross-thread frees)" : "");
+    printf("%6s  %-20s%8s%10s%10s\n", "thread", "trace", "ops", "secs",
+	   "usecs/op");
+    ops = 0;
+    for (i = 0; i < njobs; i++) {
+	printf("%6d  %-20s%8d%10.6f%10.3f\n", i, jobs[i].tracefile,
+	       jobs[i].trace->num_ops, jobs[i].secs,
+	       jobs[i].secs * 1e6 / jobs[i].trace->num_ops);
+	ops += jobs[i].trace->num_ops;
+    }
+    printf("Total   %-20s%8.0f%10.6f%10.0f Kops\n", "", ops, secs,
+	   (ops/1e3)/secs);
+    printf("Scaling efficiency vs -j 1 = %.0f%%\n",
+	   100.0 * (ops/secs) / (njobs * (base_ops/base_secs)));
+
+    for (i = 0; i < njobs; i++) {
+	free_trace(jobs[i].trace);
+	free(jobs[i].handoff);
+	pthread_mutex_destroy(&jobs[i].lock);
+    }
+    free(jobs);
+}
+
+/*
+ * run_mm_jobs - Reset the heap and replay the traces of the first njobs
+ *     jobs at once JOB_RUNS times. Returns the best wall clock time,
+ *     and leaves the time of each thread in that run in its job.
+ */
+static double run_mm_jobs(job_t *jobs, int njobs)
+{
+    int i, run;
+    double start, end, best = DBL_MAX;
+    double *job_secs;
+
+    if ((job_secs = (double *)malloc(njobs * sizeof(double))) == NULL)
+	unix_error("malloc failed in run_mm_jobs");
+    pthread_barrier_init(&job_start, NULL, njobs);
+    for (run = 0; run < JOB_RUNS; run++) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in run_mm_jobs");
+	job_busy = njobs;
+	for (i = 0; i < njobs; i++) {
+	    jobs[i].nhandoff = 0;
+	    if (pthread_create(&jobs[i].tid, NULL, job_thread, &jobs[i]) != 0)
+		unix_error("pthread_create failed in run_mm_jobs");
+	}
+	for (i = 0; i < njobs; i++)
+	    pthread_join(jobs[i].tid, NULL);
+
+	/* the run lasts from the first start to the last end */
+	start = DBL_MAX;
+	end = 0;
+	for (i = 0; i < njobs; i++) {
+	    start = (jobs[i].start < start) ? jobs[i].start : start;
+	    end = (jobs[i].end > end) ? jobs[i].end : end;
+	}
+	if (end - start < best) {
+	    best = end - start;
+	    for (i = 0; i < njobs; i++)
+		job_secs[i] = jobs[i].end - jobs[i].start;
+	}
+    }
+    for (i = 0; i < njobs; i++)
+	jobs[i].secs = job_secs[i];
+    pthread_barrier_destroy(&job_start);
+    free(job_secs);
+    return best;
+}
+
+/*
+ * job_thread - Replay the trace of a job. With -x, freed blocks are
+ *     handed to the peer thread in batches of HANDOFF_BATCH, and blocks
+ *     handed to this thread are freed every HANDOFF_BATCH requests.
+ */
+static void *job_thread(void *ptr)
+{
+    job_t *job = (job_t *)ptr;
+    trace_t *trace = job->trace;
+    char *batch[HANDOFF_BATCH];
+    int i, index, nbatch = 0;
+    char *p;
+
+    pthread_barrier_wait(&job_start);
+    job->start = job_clock();
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in job_thread");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in job_thread");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free, here or on the peer */
+	    if (!job_cross) {
+		mm_free(trace->blocks[index]);
+		break;
+	    }
+	    batch[nbatch++] = trace->blocks[index];
+	    if (nbatch == HANDOFF_BATCH) {
+		hand_off(job, job->peer, batch, nbatch);
+		nbatch = 0;
+	    }
+            break;
+
+	default:
+	    app_error("Nonexistent request type in job_thread");
+        }
+
+	/* Check a slice of the heap and the block just returned (-c) */
+	if (check_step &&
+	    !mm_check_step(trace->ops[i].type == FREE ? NULL : trace->blocks[index]))
+	    app_error("mm_check_step found the heap inconsistent in job_thread");
+	if (job_cross && i % HANDOFF_BATCH == 0)
+	    free_handed_off(job);
+    }
+
+    /* keep freeing what we are handed until every thread is done */
+    if (job_cross) {
+	hand_off(job, job->peer, batch, nbatch);
+	__sync_fetch_and_sub(&job_busy, 1);
+	while (__sync_fetch_and_add(&job_busy, 0) > 0) {
+	    free_handed_off(job);
+	    sched_yield();
+	}
+	free_handed_off(job);
+    }
+    job->end = job_clock();
+    return NULL;
+}
+
+/*
+ * hand_off - Give n blocks to the peer thread, which will free them.
+ *     If the peer already has HANDOFF_MAX blocks waiting, first wait
+ *     until it catches up, while freeing the blocks we were handed.
+ */
+static void hand_off(job_t *job, job_t *peer, char **blocks, int n)
+{
+    pthread_mutex_lock(&peer->lock);
+    while (peer != job && peer->nhandoff >= HANDOFF_MAX) {
+	pthread_mutex_unlock(&peer->lock);
+	free_handed_off(job);
+	sched_yield();
+	pthread_mutex_lock(&peer->lock);
+    }
+    if (peer->nhandoff + n > peer->maxhandoff) {
+	peer->maxhandoff = 2 * (peer->nhandoff + n);
+	if ((peer->handoff = (char **)realloc(peer->handoff, 
+			     peer->maxhandoff * sizeof(char *))) == NULL)
+	    unix_error("realloc failed in hand_off");
+    }
+    memcpy(peer->handoff + peer->nhandoff, blocks, n * sizeof(char *));
+    peer->nhandoff += n;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+/*
+ * free_handed_off - Free every block other threads have handed to job
+ */
+static void free_handed_off(job_t *job)
+{
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    for (i = 0; i < job->nhandoff; i++)
+	mm_free(job->handoff[i]);
+    job->nhandoff = 0;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * job_clock - Return the time in seconds on a monotonic clock
+ */
+static double job_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*********************************************************************
+ * The following functions time every request of a trace with the
+ * cycle counter, and keep the latencies in a log-scale histogram per
+ * request type, from which tail percentiles are read (-L).
+ *********************************************************************/
+
+/*
+ * eval_mm_latency - Replay a trace on a fresh heap, timing every call
+ *     to the mm package, and record the latencies in lat
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
+{
+    int i, index;
+    char *p;
+    unsigned long long start, cycles;
+
+    if (lat_ovhd == 0)
+	lat_ovhd = counter_ovhd();
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    /* Interpret and time each trace request */
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    start = read_counter();
+            p = mm_malloc(trace->ops[i].size);
+	    cycles = read_counter() - start;
+            if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    start = read_counter();
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    cycles = read_counter() - start;
+            if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+	    start = read_counter();
+            mm_free(trace->blocks[index]);
+	    cycles = read_counter() - start;
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	    return;
+        }
+	hist_add(&lat->op[trace->ops[i].type],
+		 (cycles > lat_ovhd) ? cycles - lat_ovhd : 0);
+    }
+}
+
+/*
+ * counter_ovhd - Return the fewest cycles between two back-to-back reads
+ *     of the cycle counter, which is subtracted from every latency
+ */
+static unsigned long long counter_ovhd(void)
+{
+    int i;
+    unsigned long long start, cycles, best = ~0ULL;
+
+    for (i = 0; i < 1000; i++) {
+	start = read_counter();
+	cycles = read_counter() - start;
+	if (cycles < best)
+	    best = cycles;
+    }
+    return (best > 0) ? best : 1;
+}
+
+/*
+ * hist_add - Count a latency in its bucket. Values below 2*HIST_SUB get
+ *     a bucket each; above that, every power of two is split into HIST_SUB
+ *     buckets, so a bucket spans at most 1/HIST_SUB of its values.
+ */
+static void hist_add(hist_t *hist, unsigned long long cycles)
+{
+    int shift = 0;
+
+    if (cycles >= HIST_SUB)
+	shift = 63 - __builtin_clzll(cycles) - HIST_SUB_BITS;
+    hist->count[(shift << HIST_SUB_BITS) + (int)(cycles >> shift)]++;
+    hist->n++;
+    if (cycles > hist->max)
+	hist->max = cycles;
+}
+
+/*
+ * hist_percentile - Return the latency that a fraction q of the counted
+ *     latencies do not exceed, as the upper bound of its bucket
+ */
+static unsigned long long hist_percentile(hist_t *hist, double q)
+{
+    int index, shift;
+    unsigned long seen = 0, rank;
+    unsigned long long bound;
+
+    rank = (unsigned long)(q * hist->n);
+    if (rank < q * hist->n || rank == 0)
+	rank++;
+    for (index = 0; index < HIST_BUCKETS; index++) {
+	if ((seen += hist->count[index]) >= rank)
+	    break;
+    }
+
+    /* the largest value of the bucket */
+    if (index < 2 * HIST_SUB)
+	bound = index;
+    else {
+	shift = (index >> HIST_SUB_BITS) - 1;
+	bound = ((unsigned long long)(index - (shift << HIST_SUB_BITS) + 1)
+		 << shift) - 1;
+    }
+    return (bound < hist->max) ? bound : hist->max;
+}
+
+/*
+ * printlatency - Print the latency percentiles of each request type
+ *     on each trace, in cycles
+ */
+static void printlatency(int n, latency_t *lats)
+{
+    int i, type;
+    hist_t *hist;
+    static char *names[] = {"malloc", "free", "realloc"};
+
+    printf("\nLatency of mm malloc requests in cycles:\n");
+    printf("%5s %-8s%8s%8s%8s%8s%8s%9s\n",
+	   "trace", "request", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < n; i++) {
+	for (type = 0; type < 3; type++) {
+	    hist = &lats[i].op[type];
+	    if (hist->n == 0)
+		continue;
+	    printf("%5d %-8s%8lu%8llu%8llu%8llu%8llu%9llu\n",
+		   i, names[type], hist->n,
+		   hist_percentile(hist, 0.50),
+		   hist_percentile(hist, 0.90),
+		   hist_percentile(hist, 0.99),
+		   hist_percentile(hist, 0.999),
+		   hist->max);
+	}
+    }
+}
+
+/*
+ * printperf - Print the hardware events of the speed run of each trace
+ *     per request, and over all traces. Events that could not be
+ *     counted are shown as "-".
+ */
+static void printperf(int n, stats_t *stats, perf_counts_t *perfs)
+{
+    int i, event;
+    double ops = 0, total[PERF_EVENTS];
+    static char *titles[PERF_EVENTS] = {
+	"cycles", "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"
+    };
+
+    printf("\nHardware events of mm malloc per request:\n");
+    printf("%5s%8s", "trace", "ops");
+    for (event = 0; event < PERF_EVENTS; event++)
+	printf("%10s", titles[event]);
+    printf("%6s\n", "IPC");
+    for (event = 0; event < PERF_EVENTS; event++)
+	total[event] = 0;
+    for (i = 0; i < n; i++) {
+	printf("%5d%8.0f", i, stats[i].ops);
+	for (event = 0; event < PERF_EVENTS; event++) {
+	    if (perfs[i].count[event] < 0) {
+		printf("%10s", "-");
+		total[event] = -1;
+	    }
+	    else {
+		printf("%10.2f", perfs[i].count[event] / stats[i].ops);
+		if (total[event] >= 0)
+		    total[event] += perfs[i].count[event];
+	    }
+	}
+	if (perfs[i].count[PERF_CYCLES] > 0 &&
+	    perfs[i].count[PERF_INSTRUCTIONS] >= 0)
+	    printf("%6.2f\n", perfs[i].count[PERF_INSTRUCTIONS] /
+		   perfs[i].count[PERF_CYCLES]);
+	else
+	    printf("%6s\n", "-");
+	ops += stats[i].ops;
+    }
+
+    printf("%5s%8.0f", "Total", ops);
+    for (event = 0; event < PERF_EVENTS; event++) {
+	if (total[event] < 0)
+	    printf("%10s", "-");
+	else
+	    printf("%10.2f", total[event] / ops);
+    }
+    if (total[PERF_CYCLES] > 0 && total[PERF_INSTRUCTIONS] >= 0)
+	printf("%6.2f\n", total[PERF_INSTRUCTIONS] / total[PERF_CYCLES]);
+    else
+	printf("%6s\n", "-");
+}
+
+/*********************************************************************
+ * The following functions print a timeline of the heap while the
+ * utilization pass replays a trace (-S): every few requests, the live
+ * payload, heap size, free space and its fragmentation, and the work
+ * mm.c did since the previous sample. The work is counted only if
+ * mm.c is built with MM_STATS.
+ *********************************************************************/
+
+/*
+ * print_sample_header - Print the title and column names of the
+ *     timeline of a trace
+ */
+static void print_sample_header(int tracenum)
+{
+    printf("\nHeap timeline of trace %d, every %d requests%s:\n", tracenum,
+	   sample_every, MM_STATS ? "" : " (work counts need MM_STATS)");
+    printf("%8s %9s %9s %5s %9s %6s %9s %5s %6s %6s %6s %6s %5s\n",
+	   "op", "live", "heap", "util", "free", "blocks", "largest",
+	   "frag", "hops/m", "hops/i", "splits", "coals", "sbrks");
+}
+
+/*
+ * print_sample - Print the heap shape after opnum requests, of which
+ *     live payload bytes are allocated, and the work done since the
+ *     sample in last, which is then updated. Fragmentation is the part
+ *     of the free space outside the largest free block; hops are list
+ *     and tree nodes visited per malloc, and per free block inserted.
+ */
+static void print_sample(int opnum, int live, mm_stats_t *last)
+{
+    mm_stats_t now;
+    unsigned long mallocs, inserts;
+
+    mm_heap_stats(&now);
+    mallocs = now.mallocs - last->mallocs;
+    inserts = now.inserts - last->inserts;
+    printf("%8d %9d %9lu %4.0f%% %9lu %6lu %9lu %4.0f%% %6.2f %6.2f %6lu %6lu %5lu\n",
+	   opnum, live, (unsigned long)now.heap_size,
+	   now.heap_size ? 100.0 * live / now.heap_size : 0.0,
+	   (unsigned long)now.free_bytes, (unsigned long)now.free_blocks,
+	   (unsigned long)now.largest_free,
+	   now.free_bytes ? 
+	   100.0 * (1.0 - (double)now.largest_free / now.free_bytes) : 0.0,
+	   mallocs ? (double)(now.search_hops - last->search_hops) / mallocs : 0.0,
+	   inserts ? (double)(now.insert_hops - last->insert_hops) / inserts : 0.0,
+	   now.splits - last->splits, now.coalesces - last->coalesces,
+	   now.sbrks - last->sbrks);
+    *last = now;
+}
+
+/*
+ * print_heap_totals - Print the work counted over a whole trace, and
+ *     the free blocks left on each segregated list at its end
+ */
+static void print_heap_totals(mm_stats_t *stats)
+{
+    int i;
+
+    if (MM_STATS) {
+	printf("Totals: %lu mallocs (%lu from quick lists), %lu lists probed, "
+	       "%lu search hops\n", stats->mallocs, stats->quick_hits,
+	       stats->lists_probed, stats->search_hops);
+	printf("        %lu inserts, %lu insert hops, %lu of %lu previous "
+	       "blocks free\n", stats->inserts, stats->insert_hops,
+	       stats->prev_free, stats->prev_lookups);
+	printf("        %lu splits, %lu coalesces, %lu quick flushes, "
+	       "%lu sbrks (+%lu/-%lu bytes)\n", stats->splits,
+	       stats->coalesces, stats->quick_flushes, stats->sbrks,
+	       stats->sbrk_bytes, stats->trim_bytes);
+    }
+    printf("Free blocks by list at the end (%lu bytes on quick lists):\n",
+	   (unsigned long)stats->quick_bytes);
+    for (i = 0; i < MM_STAT_CLASSES; i++)
+	if (stats->class_blocks[i] > 0)
+	    printf("  list %2d: %6lu blocks %9lu bytes\n", i,
+		   (unsigned long)stats->class_blocks[i],
+		   (unsigned long)stats->class_bytes[i]);
+}
+
+/*********************************************************************
+ * The following functions replay traces with runs of like requests
+ * grouped into batches (-G): up to group_max mallocs of one size in a
+ * row become one mm_malloc_batch, and up to group_max frees in a row
+ * one mm_free_batch. Reallocs are replayed one by one. The batched
+ * replay is checked, timed and measured as the ordinary one is, and
+ * compared with it.
+ *********************************************************************/
+
+/*
+ * eval_mm_groups - Replay every trace in batches, and print how many
+ *     requests each batch held on average, and the time and heap size
+ *     next to those of replaying every request by itself. Both replays
+ *     run the same loop, so that only batching tells them apart; they
+ *     are timed in turn, and the best of GROUP_RUNS times of each is
+ *     kept. The heap size of the ordinary replay comes from stats.
+ */
+static void eval_mm_groups(char **tracefiles, int num_tracefiles,
+			   stats_t *stats)
+{
+    int i, run, groups, singles;
+    double t, secs = 0, batched = 0, total_secs = 0, total_batched = 0;
+    size_t heap;
+    trace_t *trace;
+    range_t *ranges = NULL;
+    speed_t single_params, batch_params;
+
+    printf("\nResults for mm malloc with up to %d requests per batch:\n",
+	   group_max);
+    printf("%5s %8s %8s %8s %10s %10s %8s %9s %9s\n", "trace", "ops",
+	   "batches", "ops/bat", "secs", "batched", "speedup", "heap",
+	   "batched");
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	single_params.trace = batch_params.trace = trace;
+	single_params.ranges = batch_params.ranges = NULL;
+	single_params.group_ends = group_trace(trace, 1, &singles);
+	batch_params.group_ends = group_trace(trace, group_max, &groups);
+	if (replay_grouped(trace, batch_params.group_ends, i, &ranges)) {
+	    heap = mem_heap_peak();
+	    for (run = 0; run < GROUP_RUNS; run++) {
+		t = fsecs(eval_mm_grouped_speed, &single_params);
+		secs = (run == 0 || t < secs) ? t : secs;
+		t = fsecs(eval_mm_grouped_speed, &batch_params);
+		batched = (run == 0 || t < batched) ? t : batched;
+	    }
+	    printf("%5d %8d %8d %8.2f %10.6f %10.6f %7.2fx %9.0f %9lu\n", i,
+		   trace->num_ops, groups, (double)trace->num_ops / groups,
+		   secs, batched, secs / batched, stats[i].heap,
+		   (unsigned long)heap);
+	    total_secs += secs;
+	    total_batched += batched;
+	}
+	free(single_params.group_ends);
+	free(batch_params.group_ends);
+	free_trace(trace);
+    }
+    clear_ranges(&ranges);
+    if (errors == 0)
+	printf("Total %55.2fx\n", total_secs / total_batched);
+}
+
+/*
+ * group_trace - Split a trace into batches: a run of up to limit
+ *     mallocs of one size, or of frees, is one batch, and a realloc is
+ *     one by itself. Returns an array holding, for the first request
+ *     of each batch, the request after its last, and sets groups to
+ *     the number of batches.
+ */
+static int *group_trace(trace_t *trace, int limit, int *groups)
+{
+    int i, j, *ends;
+    traceop_t *op;
+
+    if ((ends = (int *)malloc(trace->num_ops * sizeof(int))) == NULL)
+	unix_error("ends malloc in group_trace failed");
+    for (i = 0, *groups = 0; i < trace->num_ops; i = j, (*groups)++) {
+	op = &trace->ops[i];
+	for (j = i + 1; j < trace->num_ops && j - i < limit &&
+		 op->type != REALLOC && trace->ops[j].type == op->type &&
+		 (op->type == FREE || trace->ops[j].size == op->size); j++)
+	    ;
+	ends[i] = j;
+    }
+    return ends;
+}
+
+/*
+ * replay_grouped - Replay a trace in the batches group_trace found, on
+ *     a fresh heap; a batch of one request is replayed as the request
+ *     itself. Unless ranges is NULL, every block is checked as
+ *     eval_mm_valid does. Returns 0 if the mm package failed a request,
+ *     and 1 otherwise.
+ */
+static int replay_grouped(trace_t *trace, int *ends, int tracenum,
+			  range_t **ranges)
+{
+    int i, k, n, got;
+    traceop_t *op;
+    void *batch[group_max];
+    char *p;
+
+    mem_reset_brk();
+    if (ranges != NULL)
+	clear_ranges(ranges);
+    if (mm_init() < 0)
+	app_error("mm_init failed in replay_grouped");
+
+    for (i = 0; i < trace->num_ops; i = ends[i]) {
+	op = &trace->ops[i];
+	n = ends[i] - i;
+
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc_batch, or mm_malloc for a batch of one */
+	    if (n == 1)
+		got = (batch[0] = mm_malloc(op->size)) != NULL;
+	    else
+		got = mm_malloc_batch(op->size, batch, n);
+	    if (got != n) {
+		if (ranges == NULL)
+		    app_error("mm_malloc_batch error in replay_grouped");
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (k = 0; k < n; k++) {
+		trace->blocks[trace->ops[i + k].index] = batch[k];
+		if (ranges != NULL &&
+		    add_range(ranges, batch[k], op->size, tracenum, i + k) == 0)
+		    return 0;
+	    }
+	    break;
+
+        case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[op->index], op->size)) == NULL) {
+		if (ranges == NULL)
+		    app_error("mm_realloc error in replay_grouped");
+		malloc_error(tracenum, i, "mm_realloc failed.");
+		return 0;
+	    }
+	    if (ranges != NULL) {
+		remove_range(ranges, trace->blocks[op->index]);
+		if (add_range(ranges, p, op->size, tracenum, i) == 0)
+		    return 0;
+	    }
+	    trace->blocks[op->index] = p;
+	    break;
+
+        case FREE: /* mm_free_batch, or mm_free for a batch of one */
+	    for (k = 0; k < n; k++) {
+		batch[k] = trace->blocks[trace->ops[i + k].index];
+		if (ranges != NULL)
+		    remove_range(ranges, batch[k]);
+	    }
+	    if (n == 1)
+		mm_free(batch[0]);
+	    else
+		mm_free_batch(batch, n);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_grouped");
+        }
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_grouped_speed - Replay a trace in batches, for fsecs
+ */
+static void eval_mm_grouped_speed(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+
+    replay_grouped(params->trace, params->group_ends, 0, NULL);
+}
+
+/*********************************************************************
+ * The following functions write the results in a machine-readable
+ * format (-o), and compare them with the results of an earlier run
+ * (--baseline).
+ *********************************************************************/
+
+/*
+ * write_report - Write the stats of every trace in given format to fp.
+ *     The latency percentiles are written only if lats is not NULL, and
+ *     the hardware event counts only if perfs is not NULL; events that
+ *     could not be counted are left empty.
+ */
+static void write_report(FILE *fp, int format, char **tracefiles, int n,
+			 stats_t *stats, latency_t *lats, perf_counts_t *perfs,
+			 double perfindex)
+{
+    int i, type, event;
+    static char *names[] = {"malloc", "free", "realloc"};
+    hist_t *hist;
+
+    if (format == REPORT_CSV) {
+	fprintf(fp, "trace,valid,ops,secs,util,kops,heap");
+	for (type = 0; lats != NULL && type < 3; type++)
+	    fprintf(fp, ",%s_p50,%s_p90,%s_p99,%s_p999,%s_max", names[type],
+		    names[type], names[type], names[type], names[type]);
+	for (event = 0; perfs != NULL && event < PERF_EVENTS; event++)
+	    fprintf(fp, ",%s", perf_event_names[event]);
+	fprintf(fp, "\n");
+	for (i = 0; i < n; i++) {
+	    fprintf(fp, "%s,%d,%.0f,%.6f,%.4f,%.0f,%.0f", tracefiles[i],
+		    stats[i].valid, stats[i].ops, stats[i].secs, stats[i].util,
+		    stats[i].valid ? (stats[i].ops/1e3)/stats[i].secs : 0,
+		    stats[i].heap);
+	    for (type = 0; lats != NULL && type < 3; type++) {
+		hist = &lats[i].op[type];
+		fprintf(fp, ",%llu,%llu,%llu,%llu,%llu",
+			hist_percentile(hist, 0.50), hist_percentile(hist, 0.90),
+			hist_percentile(hist, 0.99), hist_percentile(hist, 0.999),
+			hist->max);
+	    }
+	    for (event = 0; perfs != NULL && event < PERF_EVENTS; event++) {
+		if (perfs[i].count[event] < 0)
+		    fprintf(fp, ",");
+		else
+		    fprintf(fp, ",%.0f", perfs[i].count[event]);
+	    }
+	    fprintf(fp, "\n");
+	}
+	return;
+    }
+
+    /* JSON, with one line per trace so that read_baseline can parse it */
+    fprintf(fp, "{\n  \"perfidx\": %.0f,\n  \"traces\": [\n", perfindex);
+    for (i = 0; i < n; i++) {
+	fprintf(fp, "    {\"trace\": ");
+	json_string(fp, tracefiles[i]);
+	fprintf(fp, ", \"valid\": %d, \"ops\": %.0f, "
+		"\"secs\": %.6f, \"util\": %.4f, \"kops\": %.0f, \"heap\": %.0f",
+		stats[i].valid, stats[i].ops, stats[i].secs, stats[i].util,
+		stats[i].valid ? (stats[i].ops/1e3)/stats[i].secs : 0,
+		stats[i].heap);
+	for (type = 0; lats != NULL && type < 3; type++) {
+	    hist = &lats[i].op[type];
+	    fprintf(fp, ", \"%s\": {\"count\": %lu, \"p50\": %llu, \"p90\": %llu, "
+		    "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}", names[type],
+		    hist->n, hist_percentile(hist, 0.50),
+		    hist_percentile(hist, 0.90), hist_percentile(hist, 0.99),
+		    hist_percentile(hist, 0.999), hist->max);
+	}
+	for (event = 0; perfs != NULL && event < PERF_EVENTS; event++) {
+	    fprintf(fp, "%s\"%s\": ", (event == 0) ? ", \"events\": {" : ", ",
+		    perf_event_names[event]);
+	    if (perfs[i].count[event] < 0)
+		fprintf(fp, "null");
+	    else
+		fprintf(fp, "%.0f", perfs[i].count[event]);
+	    if (event == PERF_EVENTS - 1)
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "}%s\n", (i < n - 1) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+/*
+ * json_string - Write s to fp as a JSON string, escaping quotes,
+ *     backslashes and control characters
+ */
+static void json_string(FILE *fp, char *s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\')
+	    fprintf(fp, "\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    fprintf(fp, "\\u%04x", (unsigned char)*s);
+	else
+	    fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * json_unescape - Copy the JSON string whose opening quote precedes p
+ *     into s, of size bytes, undoing the escapes of json_string.
+ *     Returns 0 if the line ends before the closing quote.
+ */
+static int json_unescape(char *p, char *s, size_t size)
+{
+    size_t len = 0;
+    unsigned code;
+    char c;
+
+    while (*p != '"') {
+	if (*p == '\0' || *p == '\n')
+	    return 0;
+	if (*p != '\\')
+	    c = *p++;
+	else if (p[1] == 'u' && sscanf(p + 2, "%4x", &code) == 1) {
+	    c = (char)code;
+	    p += 6;
+	}
+	else if (p[1] != '\0') {
+	    c = p[1];
+	    p += 2;
+	}
+	else
+	    return 0;
+	if (len < size - 1)
+	    s[len++] = c;
+    }
+    s[len] = '\0';
+    return 1;
+}
+
+/*
+ * json_number - Find "key": in line and store the number that follows
+ *     it in *val. Returns 0 if the key is missing.
+ */
+static int json_number(char *line, char *key, double *val)
+{
+    char pattern[MAXLINE];
+    char *p;
+
+    sprintf(pattern, "\"%s\": ", key);
+    if ((p = strstr(line, pattern)) == NULL)
+	return 0;
+    *val = strtod(p + strlen(pattern), NULL);
+    return 1;
+}
+
+/*
+ * compare_baseline - Compare the stats of every trace with the stats of
+ *     the same trace in a JSON file written earlier by -o json. Prints
+ *     the deltas, and returns the number of traces whose throughput or
+ *     utilization dropped by more than a fraction tolerance.
+ */
+static int compare_baseline(char *filename, char **tracefiles, int n,
+			    stats_t *stats, double tolerance)
+{
+    FILE *fp;
+    char line[MAXLINE], name[MAXLINE];
+    char *p;
+    double ops, secs, util, kops, base_kops;
+    int i, regressions = 0, found;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	sprintf(msg, "Could not open baseline %s in compare_baseline", filename);
+	unix_error(msg);
+    }
+
+    printf("\nBaseline comparison with %s (tolerance %.1f%%):\n", filename,
+	   tolerance * 100.0);
+    printf("%-20s%7s%7s%8s%9s%9s%8s\n", "trace", "util", "base", "delta",
+	   "Kops", "base", "delta");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+
+	/* find the line of this trace in the baseline */
+	found = 0;
+	rewind(fp);
+	while (!found && fgets(line, MAXLINE, fp) != NULL) {
+	    if ((p = strstr(line, "\"trace\": \"")) == NULL)
+		continue;
+	    p += strlen("\"trace\": \"");
+	    if (!json_unescape(p, name, sizeof(name)))
+		continue;
+	    found = !strcmp(name, tracefiles[i]) &&
+		json_number(line, "ops", &ops) && json_number(line, "secs", &secs) &&
+		json_number(line, "util", &util) && secs > 0;
+	}
+	if (!found) {
+	    printf("%-20s  not in baseline\n", tracefiles[i]);
+	    continue;
+	}
+
+	kops = (stats[i].ops/1e3)/stats[i].secs;
+	base_kops = (ops/1e3)/secs;
+	printf("%-20s%6.1f%%%6.1f%%%+7.1f%%%9.0f%9.0f%+7.1f%%", tracefiles[i],
+	       stats[i].util * 100.0, util * 100.0,
+	       (stats[i].util - util) * 100.0 / util,
+	       kops, base_kops, (kops - base_kops) * 100.0 / base_kops);
+	if (stats[i].util < util * (1.0 - tolerance) ||
+	    kops < base_kops * (1.0 - tolerance)) {
+	    printf("  REGRESSION");
+	    regressions++;
+	}
+	printf("\n");
+    }
+    fclose(fp);
+    return regressions;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1005,14 +2399,28 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValxLPc] [-f <file>] [-t <dir>] [-j <n>] [-o json|csv]\n"
+	    "               [-b <file>] [--threshold <pct>] [-S <n>] [-G <n>]\n"
+	    "               [-F warm|cold]\n");
     fprintf(stderr, "Options\n");
 //    fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-b <file>  Compare with a report of -o json; exit with 2 on a\n"
+	    "\t           regression beyond --threshold percent (default 10).\n");
+    fprintf(stderr, "\t-c         Check a slice of the heap after every request.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as a trace file; may be repeated.\n");
+    fprintf(stderr, "\t-F <mode>  Time with the cycle counter, pinned to a CPU, with\n"
+	    "\t           warm caches or the data of each run flushed (cold).\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
+    fprintf(stderr, "\t-G <n>     Also replay traces with up to <n> like requests per batch.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Also replay traces on <n> threads at once.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print latency percentiles of mm requests.\n");
+    fprintf(stderr, "\t-P         Count hardware events of the mm speed runs.\n");
+    fprintf(stderr, "\t-o <fmt>   Write results as json or csv on stdout, the rest on stderr.\n");
+    fprintf(stderr, "\t-S <n>     Print a heap timeline of each trace every <n> requests.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x         With -j, free blocks on another thread.\n");
 }
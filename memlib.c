@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE          /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,6 +11,7 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +20,46 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* highest brk since the heap was last emptied */
+static char *mem_fresh_brk;  /* highest brk ever; the heap above reads as zero */
+static size_t mem_mapped;    /* bytes mapped outside the heap by mem_map */
+
+/* the live mappings made by mem_map, in no order, for mem_is_mapped */
+typedef struct {
+    char *lo;                /* first byte of the mapping */
+    size_t len;              /* its length in bytes */
+} map_t;
+static map_t *mem_maps;      /* array of mem_nmaps records, itself mapped */
+static size_t mem_nmaps;     /* number of live mappings */
+static size_t mem_maxmaps;   /* number of records mem_maps has room for */
+static char mem_maps_lock;   /* spin lock on the three above */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+#if MM_SYSTEM
+    /* reserve address space for the whole heap; pages are committed by the */
+    /* kernel as they are first touched. If that fails the heap stays empty */
+    /* and every mem_sbrk fails, since the caller may be malloc itself      */
+    void *start = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    mem_start_brk = (start != MAP_FAILED) ? (char *)start : NULL;
+    mem_max_addr = (start != MAP_FAILED) ? mem_start_brk + MAX_HEAP : NULL;
+#else
+    /* allocate the storage we will use to model the available VM, zeroed */
+    /* as the system's is                                                 */
+    if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+#endif
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_start_brk;
+    mem_fresh_brk = mem_start_brk;
 }
 
 /* 
@@ -39,7 +67,12 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+#if MM_SYSTEM
+    if (mem_start_brk != NULL)
+	munmap(mem_start_brk, MAX_HEAP);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
@@ -47,27 +80,242 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    __atomic_store_n(&mem_brk, mem_start_brk, __ATOMIC_RELEASE);
+    __atomic_store_n(&mem_peak_brk, mem_start_brk, __ATOMIC_RELEASE);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. The
+ *    brk pointer is advanced with compare-and-swap, so concurrent
+ *    callers get disjoint areas. A negative incr shrinks the heap and
+ *    gives its whole pages back with mem_release; the caller must keep
+ *    other callers from growing the heap meanwhile.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk = __atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE);
+    char *peak;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-	return (void *)-1;
+    do {
+	if ((old_brk + incr) < mem_start_brk) {
+	    errno = ENOMEM;
+	    return (void *)-1;
+	}
+	if ((old_brk + incr) > mem_max_addr) {
+	    errno = ENOMEM;
+#if !MM_SYSTEM
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+#endif
+	    return (void *)-1;
+	}
+    } while (!__atomic_compare_exchange_n(&mem_brk, &old_brk, old_brk + incr, 1,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (incr < 0) {
+	mem_release(old_brk + incr, -incr);
+	return (void *)old_brk;
     }
-    mem_brk += incr;
+
+    /* raise the high-water marks */
+    peak = __atomic_load_n(&mem_peak_brk, __ATOMIC_RELAXED);
+    while (peak < old_brk + incr &&
+	   !__atomic_compare_exchange_n(&mem_peak_brk, &peak, old_brk + incr, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    peak = __atomic_load_n(&mem_fresh_brk, __ATOMIC_RELAXED);
+    while (peak < old_brk + incr &&
+	   !__atomic_compare_exchange_n(&mem_fresh_brk, &peak, old_brk + incr, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the whole pages within len bytes at start back
+ *    to the system. They stay part of the heap, and read as zero when
+ *    next touched. The simulated heap keeps its pages, so that timing
+ *    the package does not measure page faults.
+ */
+void mem_release(void *start, size_t len)
+{
+#if MM_SYSTEM
+    uintptr_t page = (uintptr_t)mem_pagesize();
+    uintptr_t lo = ((uintptr_t)start + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)start + len) & ~(page - 1);
+
+    if (lo < hi)
+	madvise((void *)lo, hi - lo, MADV_DONTNEED);
+#endif
+}
+
+/*
+ * mem_move - move len bytes from src to dst, two areas of the heap that
+ *    do not overlap. If they lie at the same offset within a page, the
+ *    whole pages of src are moved to dst by remapping them, and src is
+ *    given fresh zeroed pages; only the partial pages at either end are
+ *    copied. Otherwise, or if remapping fails, every byte is copied.
+ */
+void mem_move(void *dst, void *src, size_t len)
+{
+#if MM_SYSTEM
+    uintptr_t page = (uintptr_t)mem_pagesize();
+    char *lo = (char *)(((uintptr_t)src + page - 1) & ~(page - 1));
+    char *hi = (char *)(((uintptr_t)src + len) & ~(page - 1));
+    char *to = (char *)dst + (lo - (char *)src);
+
+    if ((((uintptr_t)dst - (uintptr_t)src) & (page - 1)) == 0 && lo < hi &&
+	mremap(lo, hi - lo, hi - lo, MREMAP_MAYMOVE | MREMAP_FIXED, to) != MAP_FAILED) {
+	/* fill the hole left behind, or take the pages back if that fails */
+	if (mmap(lo, hi - lo, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED) {
+	    memcpy(dst, src, lo - (char *)src);
+	    memcpy(to + (hi - lo), hi, (char *)src + len - hi);
+	    return;
+	}
+	mremap(to, hi - lo, hi - lo, MREMAP_MAYMOVE | MREMAP_FIXED, lo);
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+/*
+ * map_lock, map_unlock - take and drop the lock on the mapping records.
+ *    It is only held for a few instructions, and memlib cannot depend
+ *    on libpthread, so it is a spin lock.
+ */
+static void map_lock(void)
+{
+    while (__atomic_test_and_set(&mem_maps_lock, __ATOMIC_ACQUIRE))
+	;
+}
+
+static void map_unlock(void)
+{
+    __atomic_clear(&mem_maps_lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * map_find - return the record of the mapping that starts at p, which
+ *    must be live. The caller holds the lock.
+ */
+static map_t *map_find(void *p)
+{
+    map_t *m = mem_maps;
+
+    while (m->lo != (char *)p)
+	m++;
+    return m;
+}
+
+/*
+ * mem_map - map len bytes of zeroed memory outside the heap, where len
+ *    is a multiple of the page size. Returns NULL if out of memory.
+ */
+void *mem_map(size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *maps;
+    size_t size, newsize;
+
+    if (p == MAP_FAILED) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    /* record the mapping, growing the records a page at a time; they */
+    /* are mapped too, since the caller may be malloc itself           */
+    map_lock();
+    if (mem_nmaps == mem_maxmaps) {
+	size = mem_maxmaps * sizeof(map_t);
+	newsize = size + mem_pagesize();
+	maps = (size == 0) ?
+	    mmap(NULL, newsize, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+	    mremap(mem_maps, size, newsize, MREMAP_MAYMOVE);
+	if (maps == MAP_FAILED) {
+	    map_unlock();
+	    munmap(p, len);
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	mem_maps = (map_t *)maps;
+	mem_maxmaps = newsize / sizeof(map_t);
+    }
+    mem_maps[mem_nmaps].lo = (char *)p;
+    mem_maps[mem_nmaps].len = len;
+    mem_nmaps++;
+    map_unlock();
+
+    __atomic_add_fetch(&mem_mapped, len, __ATOMIC_RELAXED);
+    return p;
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map from oldlen to newlen
+ *    bytes, moving it if needed; its pages are moved, never copied.
+ *    Returns NULL, leaving the mapping untouched, if out of memory.
+ */
+void *mem_remap(void *p, size_t oldlen, size_t newlen)
+{
+    void *newp;
+    map_t *m;
+
+    /* hold the lock across the move, so that no new mapping is made */
+    /* at p before its record has been updated                       */
+    map_lock();
+    if ((newp = mremap(p, oldlen, newlen, MREMAP_MAYMOVE)) == MAP_FAILED) {
+	map_unlock();
+	errno = ENOMEM;
+	return NULL;
+    }
+    m = map_find(p);
+    m->lo = (char *)newp;
+    m->len = newlen;
+    map_unlock();
+
+    __atomic_add_fetch(&mem_mapped, newlen - oldlen, __ATOMIC_RELAXED);
+    return newp;
+}
+
+/*
+ * mem_unmap - unmap a mapping of len bytes made by mem_map
+ */
+void mem_unmap(void *p, size_t len)
+{
+    map_lock();
+    *map_find(p) = mem_maps[--mem_nmaps];
+    map_unlock();
+    munmap(p, len);
+    __atomic_sub_fetch(&mem_mapped, len, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_is_mapped - return 1 if the bytes from lo through hi all lie
+ *    within one live mapping made by mem_map, and 0 otherwise
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    map_t *m;
+    int found = 0;
+
+    map_lock();
+    for (m = mem_maps; m < mem_maps + mem_nmaps && !found; m++)
+	found = (char *)lo >= m->lo && (char *)hi < m->lo + m->len &&
+	    lo <= hi;
+    map_unlock();
+    return found;
+}
+
+/*
+ * mem_mapsize() - returns the bytes currently mapped by mem_map
+ */
+size_t mem_mapsize()
+{
+    return __atomic_load_n(&mem_mapped, __ATOMIC_RELAXED);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,7 +329,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
 }
 
 /*
@@ -89,7 +337,26 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - mem_start_brk);
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size in bytes since the
+ *    heap was last emptied
+ */
+size_t mem_heap_peak()
+{
+    return (size_t)(__atomic_load_n(&mem_peak_brk, __ATOMIC_ACQUIRE) - mem_start_brk);
+}
+
+/*
+ * mem_heap_fresh() - returns the lowest address that mem_sbrk has never
+ *    handed out, even before the heap was last emptied. The heap from
+ *    there on has never been written, and reads as zero once handed out.
+ */
+void *mem_heap_fresh()
+{
+    return (void *)__atomic_load_n(&mem_fresh_brk, __ATOMIC_ACQUIRE);
 }
 
 /*
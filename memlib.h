@@ -3,9 +3,18 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void mem_release(void *start, size_t len);
+void mem_move(void *dst, void *src, size_t len);
+void *mem_map(size_t len);
+void *mem_remap(void *p, size_t oldlen, size_t newlen);
+void mem_unmap(void *p, size_t len);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapsize(void);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
+void *mem_heap_fresh(void);
 size_t mem_pagesize(void);
 
@@ -0,0 +1,188 @@
+/*
+ * mergetrace.c - Merge the event logs that mmtrace recorded for the
+ *                threads of a process into a single trace
+ *
+ * Usage: mergetrace [-b] <out> <log>...
+ *
+ * The events of every log are in sequence order already, so the logs
+ * are merged a request at a time. A log whose sequence numbers do not
+ * increase, or that repeats one of another log, is rejected: logs of
+ * two processes, or a log written twice, cannot be told apart
+ * otherwise. Block ids are renumbered to the lowest id not held by a
+ * live block, as rep2bin does. Frees of blocks that were never logged
+ * are dropped, and a realloc of one becomes a malloc of its new size,
+ * so that the trace only touches blocks it allocates. The trace is
+ * written in .rep format, or in the binary format with -b (see trace.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Reads the events of one log */
+typedef struct {
+    FILE *fp;             /* the log, or NULL once it is used up */
+    char *name;           /* its file name */
+    trace_event_t event;  /* its next event */
+    unsigned events;      /* events read from it so far */
+} log_t;
+
+static int next_event(log_t *log);
+static void log_error(char *msg, log_t *log);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    FILE *out;
+    log_t *logs;
+    trace_header_t header;
+    traceop_t op;
+    char magic[4];
+    int binary = 0, nlogs, i, best, id;
+    int *newid = NULL;     /* new id of every live logged id, -1 if none */
+    int maxid = 0;         /* logged ids that fit in newid */
+    int *freeids = NULL;   /* new ids that are not in use, as a stack... */
+    int nfree = 0;         /* ... of that many ids */
+    int next = 0;          /* lowest new id never used so far */
+    unsigned ops = 0;
+    uint64_t last = 0;     /* sequence number of the last event taken... */
+    int taken = 0;         /* ... if any was */
+
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+	binary = 1;
+	argc--;
+	argv++;
+    }
+    if (argc < 3) {
+	fprintf(stderr, "Usage: mergetrace [-b] <out> <log>...\n");
+	exit(1);
+    }
+    nlogs = argc - 2;
+    if ((logs = (log_t *)calloc(nlogs, sizeof(log_t))) == NULL)
+	app_error("Out of memory");
+    for (i = 0; i < nlogs; i++) {
+	logs[i].name = argv[i + 2];
+	if ((logs[i].fp = fopen(argv[i + 2], "rb")) == NULL)
+	    app_error("Could not open an event log");
+	if (fread(magic, 4, 1, logs[i].fp) != 1 || memcmp(magic, TRACE_LOG_MAGIC, 4))
+	    app_error("Not an event log");
+	next_event(&logs[i]);
+    }
+    if ((out = fopen(argv[1], "wb")) == NULL)
+	app_error("Could not open output trace");
+
+    /* the header is written again once the number of ids is known */
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.sugg_heapsize = 0;
+    header.num_ids = 0;
+    header.num_ops = 0;
+    header.weight = 1;
+    if (binary)
+	fwrite(&header, sizeof(header), 1, out);
+    else
+	fprintf(out, "%d\n%10d\n%10d\n%d\n", 0, 0, 0, 1);
+
+    for (;;) {
+	/* take the earliest event of all logs */
+	best = -1;
+	for (i = 0; i < nlogs; i++)
+	    if (logs[i].fp != NULL &&
+		(best < 0 || logs[i].event.seq < logs[best].event.seq))
+		best = i;
+	if (best < 0)
+	    break;
+	if (taken && logs[best].event.seq == last)
+	    log_error("Sequence number repeated from another log", &logs[best]);
+	last = logs[best].event.seq;
+	taken = 1;
+	op = logs[best].event.op;
+	next_event(&logs[best]);
+
+	if (op.index < 0)
+	    app_error("Bad block id in event log");
+	if (op.index >= maxid) {
+	    int oldmax = maxid;
+	    maxid = 2 * op.index + 1024;
+	    if ((newid = (int *)realloc(newid, maxid * sizeof(int))) == NULL ||
+		(freeids = (int *)realloc(freeids, maxid * sizeof(int))) == NULL)
+		app_error("Out of memory");
+	    for (i = oldmax; i < maxid; i++)
+		newid[i] = -1;
+	}
+	if (op.type == FREE) {
+	    if (newid[op.index] < 0)
+		continue; /* its block was never logged */
+	    freeids[nfree++] = id = newid[op.index];
+	    newid[op.index] = -1;
+	    op.index = id;
+	}
+	else {
+	    if (newid[op.index] < 0) {
+		if (op.type == REALLOC)
+		    op.type = ALLOC; /* its block was never logged; it starts here */
+		newid[op.index] = (nfree > 0) ? freeids[--nfree] : next++;
+	    }
+	    op.index = newid[op.index];
+	}
+
+	if (binary)
+	    fwrite(&op, sizeof(op), 1, out);
+	else if (op.type == FREE)
+	    fprintf(out, "f %d\n", op.index);
+	else
+	    fprintf(out, "%c %d %d\n", (op.type == ALLOC) ? 'a' : 'r', op.index, op.size);
+	ops++;
+    }
+
+    /* fill in the header */
+    header.num_ids = next;
+    header.num_ops = ops;
+    rewind(out);
+    if (binary)
+	fwrite(&header, sizeof(header), 1, out);
+    else
+	fprintf(out, "%d\n%10d\n%10d\n%d\n", 0, next, ops, 1);
+    if (ferror(out) || fclose(out) != 0)
+	app_error("Write error");
+    printf("%s: %u requests on %d ids from %d logs\n", argv[1], ops, next, nlogs);
+    exit(0);
+}
+
+/*
+ * next_event - Read the next event of a log, or close it at its end.
+ *     Returns 0 at the end.
+ */
+static int next_event(log_t *log)
+{
+    uint64_t seq = log->event.seq;
+
+    if (fread(&log->event, sizeof(trace_event_t), 1, log->fp) == 1) {
+	if (log->events++ > 0 && log->event.seq <= seq)
+	    log_error("Sequence numbers do not increase", log);
+	return 1;
+    }
+    fclose(log->fp);
+    log->fp = NULL;
+    return 0;
+}
+
+/*
+ * log_error - Report an error in an event log and exit
+ */
+static void log_error(char *msg, log_t *log)
+{
+    fprintf(stderr, "mergetrace: %s: %s\n", log->name, msg);
+    exit(1);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "mergetrace: %s\n", msg);
+    exit(1);
+}
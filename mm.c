@@ -3,12 +3,17 @@
  *
  * This implementation uses segregated free list to handle allocation and deallocation
  * of memory blocks. Furthermore, it utilizes the fact that given heap size is 20MB to use
- * int32_t value for header. That is, it uses 4 bytes to represent size and allocation flag.
+ * int32_t value for header. That is, it uses 4 bytes to represent size and allocation flags.
  * Thereby, an allocated block will have 4-byte header followed by payload, and no footer.
+ * Headers, footers and links are words of WORD_SIZE bytes, which becomes 8 once MAX_HEAP reaches
+ * 2 GB, so the same layout runs large heaps with 8-byte words and a 32-byte smallest block.
  * A free block, on the other hand, will have 4 metadata: header, next free block, previous
  * free block, and footer. Except for header, this metadata use space allocated for payload. 
- * There is a routine, named prev_block, which checks if a block's footer is valid by checking
- * if it is a freed block. The following is an illustration of block structure.
+ * Since only free blocks have footers, every header also carries a "previous block allocated"
+ * flag in its second lowest bit; prev_block reads this flag to decide in constant time whether
+ * the footer in front of a block is valid. The heap always ends with a zero-sized, allocated
+ * epilogue header that holds this flag for the last block. The following is an illustration
+ * of block structure.
  *
  *          ALLOCATED BLOCK                FREE BLOCK
  *         *****************            *****************
@@ -26,11 +31,50 @@
  *         *****************            *****************
  *
  * Segregated free list is always organized in ascending order, and allocation process will take
- * advantage of this to always find the best-fit for a newly allocated block. Freeing a memory will
+ * advantage of this to always find the best-fit for a newly allocated block. A 32-bit occupancy bitmap
+ * records which lists are non-empty, so that the search jumps directly to the next candidate list
+ * with a find-first-set instruction instead of probing every list head. List i holds sizes from 2^(i+4) on,
+ * unless mm.c is built with a table of size classes that sizeprof generates from traces, which gives the
+ * sizes requested most lists of their own below 4 KB. Lists at or above TREE_CLASS hold large blocks,
+ * and are kept as red-black trees keyed by size and address instead of sorted lists; a block in such
+ * a tree reuses its next and previous free block slots as left and right child links,
+ * and the following word as its parent link, whose lowest bit is the node color. Freeing a memory will
  * always result in coalescing of memory whenever possible, and malloc and realloc function will always
- * try to allocate abundant amount of memory to prevent future external fragmentation.
+ * try to allocate abundant amount of memory to prevent future external fragmentation. The one exception
+ * is a freed block with no free neighbour, of a size malloc hands out for requests up to QUICK_MAX bytes:
+ * it waits, still marked allocated, on a quick list of its size for the next request of that size. The
+ * quick lists are coalesced at once when no free block fits, before realloc moves a block, or once they
+ * grow large. The third flag bit of an allocated header records that realloc has grown the block; a
+ * block growing again is taken to keep growing, and gets some room ahead whenever the heap grows under
+ * it or it moves. mm_malloc_batch carves all its blocks one after another out of a single free block,
+ * and mm_free_batch merges the blocks it frees that are adjacent before coalescing each merged block.
+ *
+ * Requests of at most SLAB_MAX bytes bypass the blocks above and are served from slab runs instead.
+ * A run is the payload of an ordinary allocated block, aligned to RUN_SIZE, that is divided into
+ * objects of a single size class with no per-object header. Its first RUN_HEADER_SIZE bytes hold
+ * the class, the number of free objects, a list of freed objects linked through their first word,
+ * the offset of objects never handed out, and links to other runs of the class that have room.
+ * A bitmap with one bit per RUN_SIZE-aligned page of the heap tells whether a pointer lies in a run.
+ *
+ * If MM_THREADS is set, the package is thread-safe, and mm_init creates MM_ARENAS independent arenas.
+ * Each arena has its own list heads, slab runs and lock, and owns chunks of the memlib heap: a chunk
+ * starts with a word naming its owner, followed by a chain of blocks ending in its own epilogue, so
+ * blocks never coalesce across chunks. An arena whose last chunk ends at the top of the heap grows it
+ * in place; otherwise it starts a new chunk of at least ARENA_CHUNK bytes at the next ARENA_PAGE boundary,
+ * and a map from heap pages to arenas finds the owner of a block. Threads are bound to arenas round-robin;
+ * once the heap is full, a thread whose arena has no fit allocates from the others. A block freed by a
+ * thread bound to another arena is pushed, with a single compare-and-swap, on the owner's remote free
+ * stack, linked through the slot that becomes its next free block link. The owner takes the whole stack
+ * the next time it is locked or has no fit for a request, or when a pusher brings it to a multiple of
+ * REMOTE_THRESHOLD blocks and finds the owner unlocked.
+ *
+ * Every thread also keeps a cache of blocks it freed, binned by the request sizes they can serve, up to
+ * TCACHE_MAX bytes. A request that hits its bin takes no lock; an empty bin is refilled, and a full bin
+ * is flushed, TCACHE_BATCH blocks at a time while holding the arena lock once. Cached blocks stay allocated
+ * as far as the arenas are concerned. mm_init starts a new heap generation, which discards every cache.
  */
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -38,6 +82,10 @@
 #include <string.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+#if MM_THREADS
+#include <pthread.h>
+#endif
 
 
 
@@ -45,55 +93,273 @@
  * Macros *
  **********/
 
+/*
+ * Word Width; headers, footers and links between blocks are words of WORD_SIZE bytes, 4 for heaps below
+ * 2 GB and 8 for larger ones unless set with -DWORD_SIZE=n
+ */
+#ifndef WORD_SIZE
+#if MAX_HEAP < (1L << 31)
+#define WORD_SIZE   4
+#else
+#define WORD_SIZE   8
+#endif
+#endif
+#if WORD_SIZE == 4
+typedef int32_t word_t;             /* signed, so that a link can point backwards */
+#define WORD_MSB(x) (31 - __builtin_clz((uint32_t)(x) | 1))     /* index of the highest set bit */
+#elif WORD_SIZE == 8
+typedef int64_t word_t;
+#define WORD_MSB(x) (63 - __builtin_clzll((uint64_t)(x) | 1))
+#else
+#error "WORD_SIZE must be 4 or 8"
+#endif
+
+/*
+ * Size Classes; a table generated by sizeprof from traces, named with -DSIZE_CLASSES=\"file\", classes block
+ * sizes below SIZE_CLASS_MAX into its first SIZE_CLASS_SMALL lists, and sets the first TREE_CLASS after them
+ */
+#ifdef SIZE_CLASSES
+#include SIZE_CLASSES
+#endif
+
 /*
  * Constants
  */
 #define ALIGNMENT   8               /* double word (8) alignment */
 #define SIZEMASK   ~0x7             /* mask to retrieve size */
-#define FLAGMASK    0x7             /* mask to retrieve allocated flag */
+#define FLAGMASK    0x7             /* mask to retrieve allocated flags */
+#define ALLOC       0x1             /* flag set if the block itself is allocated */
+#define PREV_ALLOC  0x2             /* flag set if the previous block in heap is allocated */
+#define GROWN       0x4             /* flag set if realloc has grown the allocated block before */
 #define LIST_TOTAL  32              /* total number of segregated lists */
 #define MALLOCBUF   1 << 12         /* minimum size of allocation */
 #define REALLOCBUF  1 << 8          /* minimum additional size during reallocation */
-#define HEADER_SIZE sizeof(int32_t) /* size of block header */
+#ifndef GROW_SHIFT
+#define GROW_SHIFT  3               /* a block grown again gets 1/2^GROW_SHIFT of its size extra, */
+#endif
+#ifndef GROW_STEPS
+#define GROW_STEPS  4               /* ... but no more than 2^GROW_STEPS times what it grows by */
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX    (1 << 16)       /* ... and never more than GROW_MAX bytes */
+#endif
+#define HEADER_SIZE sizeof(word_t)  /* size of block header */
+#define MIN_BLOCK_SIZE (HEADER_SIZE << 2) /* size of smallest block, which can hold free block metadata */
+#ifndef TREE_CLASS
+#define TREE_CLASS  8               /* first list kept as a best-fit tree (2^12 bytes); LIST_TOTAL disables */
+#endif
+#if defined(SIZE_CLASSES) && ((SIZE_CLASS_MAX & (SIZE_CLASS_MAX - 1)) != 0 || SIZE_CLASS_SMALL >= LIST_TOTAL)
+#error "SIZE_CLASS_MAX must be a power of two, and SIZE_CLASS_SMALL less than LIST_TOTAL"
+#endif
 
 /*
  * Alignment Functions
  */
 #define ALIGN(size)           (((size) + (ALIGNMENT-1)) & ~0x7)  /* align a size (unused; from original code) */
 #define SIZE_T_SIZE           (ALIGN(sizeof(size_t)))            /* size_t size (unused; from original code) */
-#define ALIGN_FOR_BLOCK(size) (((size) < ALIGNMENT) ? (ALIGNMENT << 1) : \
+#define ALIGN_FOR_BLOCK(size) (((size) <= MIN_BLOCK_SIZE - HEADER_SIZE) ? MIN_BLOCK_SIZE : \
                               (((size) + HEADER_SIZE + ALIGNMENT - 1) & SIZEMASK)) /* align a size with header */
+#define MAX_ALIGN_PAD(align)  ((align) + MIN_BLOCK_SIZE - ALIGNMENT) /* largest pad align_pad can return */
 
 /*
  * Block Header-Related Functions
  */
-#define BLOCK_SIZE(ptr)          (*(int32_t*)(ptr) & SIZEMASK)     /* retrieve block size (header + payload) */
+#define BLOCK_SIZE(ptr)          (*(word_t*)(ptr) & SIZEMASK)     /* retrieve block size (header + payload) */
 #define PAYLOAD_SIZE(ptr)        (BLOCK_SIZE(ptr) - HEADER_SIZE)   /* retrieve payload size */
 #define PAYLOAD_ADDR(ptr)        ((ptr) + HEADER_SIZE)             /* retrieve payload address from block address */
 #define HEADER_ADDR(voidptr)     ((char*)(voidptr) - HEADER_SIZE)  /* retrieve block address from payload address */
-#define SET_HEADER(ptr, size)    (*(int32_t*)(ptr) = (size) | 0x1) /* set and allocate header */
-#define FREE_HEADER(ptr, size)   (*(int32_t*)(ptr) = (size)); \
-                                 (*(int32_t*)((ptr) + (size) - HEADER_SIZE) = (size)) /* set and free header and footer */
-#define NEXT_BLOCK(ptr)          ((ptr) + (*(int32_t*)(ptr) & SIZEMASK)) /* get next block in heap */
+#define SET_HEADER(ptr, size)    (*(word_t*)(ptr) = (size) | GET_PREV_ALLOC(ptr) | ALLOC, \
+                                 SET_PREV_ALLOC((ptr) + (size))) /* set and allocate header, mark next block */
+#define FREE_HEADER(ptr, size)   (*(word_t*)(ptr) = (size) | GET_PREV_ALLOC(ptr), \
+                                 *(word_t*)((ptr) + (size) - HEADER_SIZE) = (size), \
+                                 CLEAR_PREV_ALLOC((ptr) + (size))) /* set and free header and footer, mark next block */
+#define SET_EPILOGUE(ptr)        (*(word_t*)(ptr) = ALLOC)              /* set zero-sized epilogue header at heap end */
+#define NEXT_BLOCK(ptr)          ((ptr) + (*(word_t*)(ptr) & SIZEMASK)) /* get next block in heap */
 #define NEXT_LIST_HEADER(ptr)    ((ptr) + (HEADER_SIZE << 1))            /* get next segregated list head */
-#define IS_SET(ptr)              ((*(int32_t*)(ptr) & FLAGMASK) == 0x1)  /* true if a block is marked allocated */
+#define LIST_HEADER(index)       (arena->head + (index) * (HEADER_SIZE << 1)) /* get list head of arena by its index */
+#define LIST_INDEX(list)         (((list) - arena->head) / (HEADER_SIZE << 1)) /* get index of a list head of arena */
+#define IS_LIST_HEADER(ptr)      ((ptr) < first)                         /* true if a pointer is a list head */
+#define IS_SET(ptr)              (*(word_t*)(ptr) & ALLOC)              /* true if a block is marked allocated */
+#define IS_EPILOGUE(ptr)         (BLOCK_SIZE(ptr) == 0)                  /* true if a block is the heap epilogue */
+#define GET_PREV_ALLOC(ptr)      (*(word_t*)(ptr) & PREV_ALLOC)         /* true if the previous block is allocated */
+#define SET_PREV_ALLOC(ptr)      (*(word_t*)(ptr) |= PREV_ALLOC)        /* mark the previous block allocated */
+#define CLEAR_PREV_ALLOC(ptr)    (*(word_t*)(ptr) &= ~PREV_ALLOC)       /* mark the previous block free */
+#define IS_GROWN(ptr)            (*(word_t*)(ptr) & GROWN)               /* true if realloc grew the block before */
+#define SET_GROWN(ptr)           (*(word_t*)(ptr) |= GROWN)              /* mark the block grown; setting its header clears it */
 
 /*
  * Free List Related Functions
  */
-#define NEXT_FREE_BLOCK_VAL(ptr)          (*(int32_t*)((ptr) + HEADER_SIZE))        /* get next free block value */
-#define PREV_FREE_BLOCK_VAL(ptr)          (*(int32_t*)((ptr) + (HEADER_SIZE << 1))) /* get previous free block value */
-#define SET_NEXT_FREE_BLOCK(ptr, nextptr) (NEXT_FREE_BLOCK_VAL(ptr) = (int32_t)((nextptr) - (ptr))) /* set next free block */
-#define SET_PREV_FREE_BLOCK(ptr, prevptr) (PREV_FREE_BLOCK_VAL(ptr) = (int32_t)((prevptr) - (ptr))) /* set previous free block */
+#define NEXT_FREE_BLOCK_VAL(ptr)          (*(word_t*)((ptr) + HEADER_SIZE))        /* get next free block value */
+#define PREV_FREE_BLOCK_VAL(ptr)          (*(word_t*)((ptr) + (HEADER_SIZE << 1))) /* get previous free block value */
+#define SET_NEXT_FREE_BLOCK(ptr, nextptr) (NEXT_FREE_BLOCK_VAL(ptr) = (word_t)((nextptr) - (ptr))) /* set next free block */
+#define SET_PREV_FREE_BLOCK(ptr, prevptr) (PREV_FREE_BLOCK_VAL(ptr) = (word_t)((prevptr) - (ptr))) /* set previous free block */
 #define NEXT_FREE_BLOCK(ptr)              ((ptr) + NEXT_FREE_BLOCK_VAL(ptr))        /* get next free block pointer */
 #define PREV_FREE_BLOCK(ptr)              ((ptr) + PREV_FREE_BLOCK_VAL(ptr))        /* get previous free block pointer */
 #define IS_END(ptr)                       ((NEXT_FREE_BLOCK_VAL(ptr)) == 0)         /* true if reached end of free list */
+#define LIST_TAIL_VAL(list)               (*(word_t*)(list))                        /* last block of a list, in the spare header slot of its head */
+#define LIST_TAIL(list)                   ((list) + LIST_TAIL_VAL(list))            /* get last (largest) block of a non-empty list */
+#define SET_LIST_TAIL(list, ptr)          (LIST_TAIL_VAL(list) = (word_t)((ptr) - (list))) /* set last block of a list */
+
+/*
+ * Best-Fit Tree Related Functions; a link of 0 represents NULL since a block never links to itself
+ */
+#define RED                      0x1                                         /* color flag kept in parent link */
+#define LEFT_VAL(ptr)            NEXT_FREE_BLOCK_VAL(ptr)                    /* left child uses next free block slot */
+#define RIGHT_VAL(ptr)           PREV_FREE_BLOCK_VAL(ptr)                    /* right child uses prev free block slot */
+#define PARENT_VAL(ptr)          (*(word_t*)((ptr) + HEADER_SIZE * 3))      /* parent link and color value */
+#define TREE_LINK(ptr, val)      ((val) ? (ptr) + (val) : NULL)              /* convert tree link value to pointer */
+#define TREE_OFFSET(ptr, target) ((target) ? (word_t)((target) - (ptr)) : 0) /* convert pointer to tree link value */
+#define LEFT(ptr)                TREE_LINK(ptr, LEFT_VAL(ptr))               /* get left child */
+#define RIGHT(ptr)               TREE_LINK(ptr, RIGHT_VAL(ptr))              /* get right child */
+#define PARENT(ptr)              TREE_LINK(ptr, PARENT_VAL(ptr) & SIZEMASK)  /* get parent */
+#define TREE_ROOT(list)          TREE_LINK(list, NEXT_FREE_BLOCK_VAL(list))  /* get root of tree stored at list head */
+#define SET_LEFT(ptr, child)     (LEFT_VAL(ptr) = TREE_OFFSET(ptr, child))   /* set left child */
+#define SET_RIGHT(ptr, child)    (RIGHT_VAL(ptr) = TREE_OFFSET(ptr, child))  /* set right child */
+#define SET_PARENT(ptr, parent)  (PARENT_VAL(ptr) = TREE_OFFSET(ptr, parent) | (PARENT_VAL(ptr) & RED)) /* set parent */
+#define SET_TREE_ROOT(list, ptr) (NEXT_FREE_BLOCK_VAL(list) = TREE_OFFSET(list, ptr)) /* set root of tree */
+#define IS_RED(ptr)              ((ptr) != NULL && (PARENT_VAL(ptr) & RED))  /* true if a node is red; NULL is black */
+#define SET_RED(ptr)             (PARENT_VAL(ptr) |= RED)                    /* color a node red */
+#define SET_BLACK(ptr)           (PARENT_VAL(ptr) &= ~RED)                   /* color a node black */
+#define IS_TREE_CLASS(index)     ((index) >= TREE_CLASS)                     /* true if a list is kept as a tree */
+#define KEY_LESS(a, b)           (BLOCK_SIZE(a) < BLOCK_SIZE(b) || \
+                                 (BLOCK_SIZE(a) == BLOCK_SIZE(b) && (a) < (b))) /* order by size, then address */
+
+/*
+ * Slab Related Functions
+ */
+#define SLAB_MAX                 64                                   /* largest request served from a slab run */
+#define SLAB_CLASSES             (SLAB_MAX / ALIGNMENT)               /* number of slab classes, one per 8 bytes */
+#define SLAB_THRESHOLD           64                                   /* live small blocks before runs are used */
+#define SMALL_BLOCK_MAX          (ALIGN_FOR_BLOCK(SLAB_MAX) + MIN_BLOCK_SIZE - ALIGNMENT) /* largest ordinary block for a small request */
+#define RUN_SHIFT                12                                   /* log2 of run size */
+#define RUN_SIZE                 (1 << RUN_SHIFT)                     /* size and alignment of a slab run */
+#define RUN_HEADER_SIZE          (16 + (HEADER_SIZE << 1))            /* size of run metadata in front of objects */
+#define SLAB_MAP_WORDS           ((MAX_HEAP >> RUN_SHIFT) / 32 + 2)   /* words in bitmap of pages holding runs */
+#define SLAB_CLASS(size)         (((size) - 1) / ALIGNMENT)           /* slab class of a request size */
+#define SLAB_OBJ_SIZE(cls)       (((cls) + 1) * ALIGNMENT)            /* object size of a slab class */
+#define RUN_CAPACITY(cls)        ((RUN_SIZE - RUN_HEADER_SIZE) / SLAB_OBJ_SIZE(cls)) /* objects in a run */
+#define RUN_OF(ptr)              ((char*)((uintptr_t)(ptr) & ~(uintptr_t)(RUN_SIZE - 1))) /* run of an object */
+#define RUN_CLASS(run)           (*(int32_t*)(run))                   /* slab class of run */
+#define RUN_NFREE(run)           (*(int32_t*)((run) + 4))             /* number of free objects in run */
+#define RUN_FREE(run)            (*(int32_t*)((run) + 8))             /* offset of first freed object; 0 if none */
+#define RUN_BUMP(run)            (*(int32_t*)((run) + 12))            /* offset of first never used object */
+#define RUN_NEXT_VAL(run)        (*(word_t*)((run) + 16))             /* next run of class with room; 0 if none */
+#define RUN_PREV_VAL(run)        (*(word_t*)((run) + 16 + HEADER_SIZE)) /* previous run of class with room; 0 if none */
+#define RUN_NEXT(run)            (RUN_NEXT_VAL(run) ? (run) + RUN_NEXT_VAL(run) : NULL) /* get next run */
+#define RUN_PREV(run)            (RUN_PREV_VAL(run) ? (run) + RUN_PREV_VAL(run) : NULL) /* get previous run */
+#define RUN_INDEX(ptr)           (((uintptr_t)(ptr) >> RUN_SHIFT) - run_base) /* page index of a pointer */
+#define IS_SLAB(ptr)             ((__atomic_load_n(&slab_map[RUN_INDEX(ptr) >> 5], __ATOMIC_RELAXED) >> \
+                                 (RUN_INDEX(ptr) & 31)) & 1)                          /* true if in a run */
+#define SET_SLAB(ptr)            __atomic_fetch_or(&slab_map[RUN_INDEX(ptr) >> 5], \
+                                 1u << (RUN_INDEX(ptr) & 31), __ATOMIC_RELAXED)     /* mark run; arenas share words */
+#define CLEAR_SLAB(ptr)          __atomic_fetch_and(&slab_map[RUN_INDEX(ptr) >> 5], \
+                                 ~(1u << (RUN_INDEX(ptr) & 31)), __ATOMIC_RELAXED)  /* unmark run */
+
+/*
+ * Mapped Block Related Functions
+ */
+#define MAP_HEADER_SIZE          16                                   /* header in front of a mapped payload */
+#define MAP_START(ptr)           ((char*)(ptr) - MAP_HEADER_SIZE)     /* start of the mapping of a payload */
+#define MAP_LENGTH(ptr)          (*(size_t*)MAP_START(ptr))           /* length of the mapping of a payload */
+#define IS_MAPPED(ptr)           (RUN_INDEX(ptr) > run_limit)         /* true if outside heap */
+
+/*
+ * Quick List Related Functions
+ */
+#if QUICK_MAX >= (MALLOCBUF)
+#error "QUICK_MAX must be less than MALLOCBUF"
+#endif
+#define QUICK_CLASSES            12                                   /* one per power of two below MALLOCBUF */
+#define QUICK_NEXT(ptr)          (*(char**)PAYLOAD_ADDR(ptr))         /* next block on a quick list */
+
+/*
+ * Thread Cache Related Functions
+ */
+#define TCACHE_POW2_BINS         4                                    /* power of two bins above SLAB_MAX */
+#define TCACHE_MAX               (SLAB_MAX << TCACHE_POW2_BINS)       /* largest request served from a cache */
+#define TCACHE_BINS              (SLAB_CLASSES + TCACHE_POW2_BINS)    /* bins per thread cache */
+#define TCACHE_COUNT             16                                   /* most blocks cached in a bin */
+#define TCACHE_BATCH             8                                    /* blocks moved per refill or flush */
+#define TCACHE_NEXT(ptr)         (*(void**)(ptr))                     /* next cached block in a bin */
+
+/*
+ * Arena Related Functions
+ */
+#if MM_ARENAS > 1 && !MM_THREADS
+#error "MM_ARENAS > 1 requires MM_THREADS"
+#endif
+#define ARENA_PAGE_SHIFT         12                                   /* log2 of the granularity of arena chunks */
+#define ARENA_PAGE               (1 << ARENA_PAGE_SHIFT)              /* a new chunk starts at a page boundary */
+#define ARENA_PAGES              (MAX_HEAP >> ARENA_PAGE_SHIFT)       /* pages in the largest heap */
+#define PAGE_INDEX(ptr)          (((char*)(ptr) - (char*)mem_heap_lo()) >> ARENA_PAGE_SHIFT) /* heap page of pointer */
+#if MM_ARENAS > 1
+#define ARENA_OF(ptr)            (&arenas[arena_map[PAGE_INDEX(ptr)]]) /* arena owning a block */
+#define ARENA_PAD(brk)           ((word_t)(-((brk) - (char*)mem_heap_lo()) & (ARENA_PAGE - 1))) /* to next page */
+#define ARENA_CHUNK              (16 * ARENA_PAGE)                    /* least size of a new chunk */
+#define RETRY_MALLOC(tried, size, align) retry_malloc(tried, size, align) /* allocate from another arena */
+#else
+#define ARENA_OF(ptr)            (arenas)                             /* the only arena owns every block */
+#define ARENA_PAD(brk)           0                                    /* the only arena needs no page boundaries */
+#define ARENA_CHUNK              0                                    /* ... and grows in place */
+#define RETRY_MALLOC(tried, size, align) NULL                         /* ... so no other arena has room */
+#endif
+#if MM_THREADS
+#define LOCK_ARENA(a)            lock_arena(a)                        /* enter an arena, making it current */
+#define UNLOCK_ARENA()           pthread_mutex_unlock(&arena->lock)   /* leave the current arena */
+#define TRYLOCK_ARENA(a)         (pthread_mutex_trylock(&(a)->lock) == 0 ? (arena = (a), 1) : 0) /* enter if free */
+#define HOME_ARENA()             (tcache_get()->home)                 /* arena the calling thread is bound to */
+#define REMOTE_THRESHOLD         64                                   /* remote frees that prompt a drain */
+#define REMOTE_NEXT_VAL(ptr)     (*(word_t*)(ptr))                   /* next free block slot of a payload */
+#define REMOTE_NEXT(ptr)         (REMOTE_NEXT_VAL(ptr) ? (char*)(ptr) + REMOTE_NEXT_VAL(ptr) : NULL) /* next on stack */
+#define DRAIN_REMOTE()           drain_remote()                       /* free blocks queued by other threads */
+#define LOCK_GROW()              pthread_mutex_lock(&grow_lock)       /* serialize growth at the top of the heap */
+#define UNLOCK_GROW()            pthread_mutex_unlock(&grow_lock)
+#else
+#define HOME_ARENA()             (arenas)
+#define LOCK_ARENA(a)            ((void)(a))
+#define UNLOCK_ARENA()           ((void)0)
+#define TRYLOCK_ARENA(a)         ((void)(a), 1)
+#define DRAIN_REMOTE()           0
+#define LOCK_GROW()              ((void)0)
+#define UNLOCK_GROW()            ((void)0)
+#endif
+
+/*
+ * Statistics Related Functions
+ */
+#if LIST_TOTAL > MM_STAT_CLASSES
+#error "mm_stats_t reports on fewer lists than LIST_TOTAL"
+#endif
+#if MM_STATS
+#define STAT(field, n)           (arena->stats.field += (n))          /* count an event of the current arena */
+#else
+#define STAT(field, n)           ((void)0)                            /* counting compiles to nothing */
+#endif
 
 /*
  * Heap Space Related Functions
  */ 
-#define IS_WITHIN_HEAP(ptr)      ((ptr) <= (char*)mem_heap_hi())        /* true if a pointer does not exceed the heap */
-#define GET_LAST_BLOCK_IF_FREE() (prev_block((char*)mem_heap_hi() + 1)) /* gets last block in heap, only if it is free */
+#define EPILOGUE_ADDR()          ((char*)mem_heap_hi() + 1 - HEADER_SIZE) /* address of epilogue header at heap end */
+#define IS_WITHIN_HEAP(ptr)      ((ptr) < EPILOGUE_ADDR())                /* true if a pointer is before the epilogue */
+#define GET_LAST_BLOCK_IF_FREE() (arena->top != NULL ? prev_block(arena->top) : NULL) /* last block of arena if free */
+#define CALLOC_CLEAR             TCACHE_MAX                           /* largest calloc cleared whole, seldom fresh */
+
+/*
+ * Batch Related Functions
+ */
+#define SORT_SMALL               16                                   /* longest batch of frees sorted by insertion */
+
+/*
+ * Incremental Checker Related Functions
+ */
+#define CHECK_SLICE              8                                    /* heap blocks mm_check_step walks per call */
+#define IS_BLOCK_ADDR(ptr)       ((ptr) >= first && IS_WITHIN_HEAP(ptr) && \
+                                 (uintptr_t)PAYLOAD_ADDR(ptr) % ALIGNMENT == 0) /* true if a pointer may be a block */
+#define GET_CURSOR()             __atomic_load_n(&check_cursor, __ATOMIC_RELAXED)
+#define KEEP_CURSOR(ptr, size)   ((GET_CURSOR() > (ptr) && GET_CURSOR() < (ptr) + (size)) ? \
+                                 __atomic_store_n(&check_cursor, (ptr), __ATOMIC_RELAXED) : (void)0) \
+                                 /* move the cursor off a block header merged into the block at ptr */
 
 
 
@@ -101,8 +367,53 @@
  * Global Variables *
  ********************/
 
-static char *head;  /* Points to the start of segregated free list heads */
-static char *first; /* Points to the first allocated/freed block */
+typedef struct {
+    char *head;                         /* start of the segregated free list heads of this arena */
+    char *top;                          /* epilogue of the last chunk of this arena; NULL if it has none */
+    uint32_t list_bitmap;               /* bit i is set if and only if segregated list i is non-empty */
+    char *slab_runs[SLAB_CLASSES];      /* first run with free objects, for each slab class */
+    int small_live;                     /* number of live ordinary blocks of at most SMALL_BLOCK_MAX bytes */
+    int slab_ready;                     /* set once small_live reaches SLAB_THRESHOLD; small requests use runs */
+    char *quick[QUICK_CLASSES];         /* freed blocks awaiting coalescing, for each power of two request */
+    word_t quick_bytes;                 /* total size of the blocks on quick lists */
+    char *touched;                      /* free block inserted last, for mm_check_step; NULL once removed */
+    char *fresh;                        /* first never used byte of the heap the arena last grew by, if any */
+#if MM_STATS
+    mm_stats_t stats;                   /* event counts of this arena; its shape fields are unused */
+#endif
+#if MM_THREADS
+    pthread_mutex_t lock;               /* guards everything above, and the blocks of this arena */
+    char *remote;                       /* lock-free stack of payloads freed by other threads */
+    unsigned remote_count;              /* number of blocks pushed on remote since it was last drained */
+#endif
+} arena_t;
+
+static char *first;           /* Points to the first allocated/freed block (or the epilogue) */
+static arena_t arenas[MM_ARENAS];         /* Independent heaps, each with its own lists and chunks */
+static uint32_t slab_map[SLAB_MAP_WORDS]; /* Bit i is set if heap page i is the start of a slab run */
+static uintptr_t run_base;              /* Page number of the page containing the start of the heap */
+static uintptr_t run_limit;             /* Page index of the last byte the heap can reach */
+static char *check_cursor;              /* Block mm_check_step walks from next; NULL starts over at first */
+#if MM_ARENAS > 1
+static unsigned char arena_map[ARENA_PAGES]; /* Index of the arena owning each heap page */
+#endif
+#if MM_THREADS
+typedef struct {
+    unsigned generation;                /* heap generation the cached blocks belong to */
+    arena_t *home;                      /* arena the thread allocates from */
+    int count[TCACHE_BINS];             /* number of blocks in each bin */
+    void *bins[TCACHE_BINS];            /* cached blocks of each bin, linked through their first word */
+} tcache_t;
+static __thread arena_t *arena;         /* Arena locked by the calling thread */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards growth of the memlib heap */
+static unsigned next_arena;             /* Arena the next new thread is bound to, round-robin */
+static unsigned heap_generation;        /* Incremented by mm_init; caches of older generations are stale */
+static __thread tcache_t tcache;        /* Cache of the calling thread */
+static pthread_key_t tcache_key;        /* Flushes the cache of a thread when it exits */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#else
+static arena_t *arena = arenas;         /* The only arena */
+#endif
 
 
 
@@ -113,13 +424,85 @@ static char *first; /* Points to the first allocated/freed block */
 int mm_init(void);
 void *mm_malloc(size_t size);
 void mm_free(void *ptr);
+void mm_free_sized(void *ptr, size_t size);
 void *mm_realloc(void *ptr, size_t size);
-static void split_block(char *blkptr, int32_t newsize);
+void *mm_memalign(size_t align, size_t size);
+void *mm_aligned_alloc(size_t align, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+size_t mm_usable_size(void *ptr);
+void *mm_malloc_usable(size_t size, size_t *usable);
+size_t mm_malloc_batch(size_t size, void **ptrs, size_t n);
+void mm_free_batch(void **ptrs, size_t n);
+void mm_lock_all(void);
+void mm_unlock_all(void);
+static void *heap_malloc(size_t size);
+static void *heap_memalign(size_t align, size_t size);
+static void heap_free(void *ptr);
+static void heap_free_block(char *blkptr);
+static void free_block(char *blkptr);
+static void *heap_realloc(void *ptr, size_t size);
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n);
+static void heap_free_batch(void **ptrs, size_t n);
+static void sort_ptrs(void **ptrs, size_t n);
+static int compare_ptrs(const void *a, const void *b);
+static void split_block(char *blkptr, word_t newsize);
+static char *find_free_block(word_t size);
+static int quick_class(word_t size);
+static void flush_quick(void);
+static char *extend_heap(word_t size);
+static char *grow_arena(word_t size, word_t fresh);
+static void release_block(char *blkptr, char *lo, char *hi);
+static word_t align_pad(char *blkptr, word_t align, word_t offset);
+static word_t grow_size(char *blkptr, word_t newsize);
+static char *alloc_aligned(word_t newsize, word_t align, word_t offset);
 static char *prev_block(char *blkptr);
-static char *search_free_list(int32_t size);
+static int size_class(word_t size);
+static char *search_free_list(word_t size);
+static char *find_fit(int index, word_t size);
 static void insert_into_list(char *blkptr);
 static void remove_from_list(char *blkptr);
+static void rotate_left(char *list, char *node);
+static void rotate_right(char *list, char *node);
+static void tree_replace(char *list, char *node, char *child);
+static void tree_insert(char *list, char *node);
+static void tree_remove(char *list, char *node);
+static char *tree_best_fit(char *list, word_t size);
+static char *tree_next(char *list, char *node);
+static int tree_contains(char *list, char *node);
+static void *slab_malloc(size_t size);
+static void slab_free(char *ptr);
+static char *new_run(int cls);
+static void unlink_run(char *run);
+static size_t map_length(size_t size);
+static void *map_malloc(size_t size);
+static void *map_realloc(void *ptr, size_t size);
+static void map_free(void *ptr);
+#if MM_THREADS
+static void lock_arena(arena_t *a);
+static int drain_remote(void);
+static void remote_free(arena_t *owner, void *ptr);
+static void free_to_owner(void *ptr);
+#if MM_ARENAS > 1
+static void *retry_malloc(arena_t *tried, size_t size, size_t align);
+#endif
+static int tcache_bin(size_t size);
+static int tcache_usable_bin(void *ptr);
+static tcache_t *tcache_get(void);
+static void *tcache_malloc(size_t size);
+static int tcache_free(void *ptr);
+static void tcache_make_key(void);
+static void tcache_release(void *arg);
+#endif
+static int check_tree(char *node, char *parent, char *lo, char *hi, int index);
+static char *next_heap_block(char *blkptr);
+void mm_heap_stats(mm_stats_t *stats);
 int mm_check(void);
+int mm_check_step(void *ptr);
+static int check_arena(void);
+static int check_block(char *blkptr);
+static int check_slice(void);
+static int check_payload(void *ptr);
+static int check_links(char *blkptr);
 
 
 
@@ -129,34 +512,409 @@ int mm_check(void);
 
 /* 
  * mm_init - Initialize the malloc package.
- *     Sets up segregated free list heads and extends heap by initial heap size.
+ *     Sets up segregated free list heads of every arena and the epilogue of the first arena, and extends
+ *     heap by initial heap size.
  */
 int mm_init(void)
 {
-    /* init_size - size that can contain all heads of segregated list, aligned */
-    int32_t init_size = ((2 * HEADER_SIZE * LIST_TOTAL + HEADER_SIZE
+    /* init_size - size that can contain all heads of segregated lists of every arena, aligned */
+    word_t init_size = ((2 * HEADER_SIZE * LIST_TOTAL * MM_ARENAS + HEADER_SIZE
                             + ALIGNMENT - 1) & SIZEMASK) - HEADER_SIZE;
-    if ((head = (char*)mem_sbrk(init_size)) == (char*)-1)
+    char *heads;
+    int i;
+
+    if ((heads = (char*)mem_sbrk(init_size + HEADER_SIZE)) == (char*)-1)
         return -1;
     
     /* initialize segregated list */
-    memset(head, 0, mem_heapsize());
-    first = (char*)mem_heap_hi() + 1;
+    memset(heads, 0, mem_heapsize());
+    first = heads + init_size;
+
+    /* every arena starts with empty lists, no slab runs, and no chunks */
+    for (i = 0; i < MM_ARENAS; i++) {
+        arena = &arenas[i];
+        arena->head = heads + i * LIST_TOTAL * (HEADER_SIZE << 1);
+        arena->top = NULL;
+        arena->list_bitmap = 0;
+        memset(arena->slab_runs, 0, sizeof(arena->slab_runs));
+        arena->small_live = 0;
+        arena->slab_ready = 0;
+        memset(arena->quick, 0, sizeof(arena->quick));
+        arena->quick_bytes = 0;
+        arena->touched = NULL;
+        arena->fresh = NULL;
+#if MM_STATS
+        memset(&arena->stats, 0, sizeof(arena->stats));
+#endif
+#if MM_THREADS
+        if (heap_generation == 0)
+            pthread_mutex_init(&arena->lock, NULL);
+        arena->remote = NULL;
+        arena->remote_count = 0;
+#endif
+    }
+    memset(slab_map, 0, sizeof(slab_map));
+    run_base = (uintptr_t)mem_heap_lo() >> RUN_SHIFT;
+    run_limit = RUN_INDEX((char*)mem_heap_lo() + MAX_HEAP - 1);
+    check_cursor = NULL;
+#if MM_ARENAS > 1
+    memset(arena_map, 0, sizeof(arena_map)); /* the list heads belong to the first arena */
+#endif
+
+    /* the list heads behave as an allocated block in front of the first block, which starts the */
+    /* initial chunk of the first arena                                                        */
+    arena = arenas;
+    arena->top = first;
+    SET_EPILOGUE(first);
+    SET_PREV_ALLOC(first);
+
+#if MM_THREADS
+    heap_generation++; /* blocks cached by any thread belong to the previous heap */
+    next_arena = 0;    /* the first thread to use the new heap gets the first arena */
+#endif
 
     /* allocate initial heap */
-    mm_free(mm_malloc(MALLOCBUF));
+    heap_free(heap_malloc(MALLOCBUF));
     return 0;
 }
 
-/* 
- * mm_malloc - Allocate a block. First, round the requested size into nearest 2s power;
- *     then, search for segregated free block list for best-fit. If none, extend the heap
- *     by at least MALLOCBUF, and then allocate.
+/*
+ * mm_malloc - Allocate a block. If thread-safe, requests of at most TCACHE_MAX bytes are served from the
+ *     cache of the calling thread. Requests of at least MMAP_THRESHOLD bytes get a mapping of their own, and
+ *     any other request holds the lock of the arena it is bound to.
  */
 void *mm_malloc(size_t size)
+{
+    void *ptr;
+
+#if MM_THREADS
+    if (size != 0 && size <= TCACHE_MAX)
+        return tcache_malloc(size);
+#endif
+    if (MMAP_THRESHOLD && size >= MMAP_THRESHOLD)
+        return map_malloc(size);
+    else if (size > MAX_HEAP)
+        return NULL;
+    LOCK_ARENA(HOME_ARENA());
+    ptr = heap_malloc(size);
+    UNLOCK_ARENA();
+    return (ptr != NULL) ? ptr : RETRY_MALLOC(HOME_ARENA(), size, 0);
+}
+
+/*
+ * mm_free - Free an allocated block. If thread-safe, a small enough block is kept in the cache of the
+ *     calling thread; any other block is freed holding the lock of its arena if the thread is bound to it,
+ *     and is pushed on the remote free stack of the owner otherwise.
+ */
+void mm_free(void *ptr)
+{
+    arena_t *owner;
+
+    if (ptr == NULL)
+        return;
+    else if (MMAP_THRESHOLD && IS_MAPPED(ptr)) {
+        map_free(ptr);
+        return;
+    }
+#if MM_THREADS
+    if (tcache_free(ptr))
+        return;
+#endif
+    owner = ARENA_OF(ptr);
+#if MM_ARENAS > 1
+    if (owner != HOME_ARENA()) {
+        remote_free(owner, ptr);
+        return;
+    }
+#endif
+    LOCK_ARENA(owner);
+    heap_free(ptr);
+    UNLOCK_ARENA();
+}
+
+/*
+ * mm_free_sized - Free an allocated block, given the size it was last requested with by mm_malloc, mm_realloc,
+ *     mm_memalign or mm_malloc_batch. A block of more than SLAB_MAX bytes is never a slab object, so it is
+ *     freed without looking it up in the slab bitmap, and if thread-safe, a block of at least twice TCACHE_MAX
+ *     bytes skips the thread cache too. A block of more than QUICK_MAX bytes is never kept on a quick list, so
+ *     it is coalesced right away without working out its quick class. Smaller blocks are freed as mm_free
+ *     does. Passing a size larger than the block was requested with corrupts the heap.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    arena_t *owner;
+
+    if (ptr == NULL || size <= SLAB_MAX || (MMAP_THRESHOLD && IS_MAPPED(ptr))) {
+        mm_free(ptr);
+        return;
+    }
+#if MM_THREADS
+    if (size < (TCACHE_MAX << 1) && tcache_free(ptr))
+        return;
+#endif
+    owner = ARENA_OF(ptr);
+#if MM_ARENAS > 1
+    if (owner != HOME_ARENA()) {
+        remote_free(owner, ptr);
+        return;
+    }
+#endif
+    LOCK_ARENA(owner);
+    if (size > QUICK_MAX)
+        free_block(HEADER_ADDR(ptr));
+    else
+        heap_free_block(HEADER_ADDR(ptr));
+    UNLOCK_ARENA();
+}
+
+/*
+ * mm_realloc - Reallocate an allocated block, holding the lock of its arena if thread-safe. A block that
+ *     grows to MMAP_THRESHOLD bytes moves to a mapping of its own, which later grows without copying. A
+ *     block that has to move while its arena is out of room moves to another arena.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    void *newptr;
+    size_t oldsize;
+
+    if (ptr == NULL)
+        return mm_malloc(size);
+    else if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    } else if (MMAP_THRESHOLD && IS_MAPPED(ptr))
+        return map_realloc(ptr, size);
+    else if (MMAP_THRESHOLD && size >= MMAP_THRESHOLD) {
+        if ((newptr = map_malloc(size)) == NULL)
+            return NULL;
+        oldsize = mm_usable_size(ptr);
+        memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+        mm_free(ptr);
+        return newptr;
+    } else if (size > MAX_HEAP)
+        return NULL;
+    LOCK_ARENA(ARENA_OF(ptr));
+    newptr = heap_realloc(ptr, size);
+    UNLOCK_ARENA();
+    if (newptr == NULL && (newptr = RETRY_MALLOC(ARENA_OF(ptr), size, 0)) != NULL) {
+        oldsize = mm_usable_size(ptr);
+        memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+        mm_free(ptr);
+    }
+    return newptr;
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload is aligned to align bytes, a power of two. Alignments up to
+ *     ALIGNMENT are met by every block; larger ones carve the block out of a free block with heap_memalign,
+ *     holding the lock of the arena the calling thread is bound to, or of another arena if that one is out
+ *     of room. Returns NULL if out of memory.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+    else if (MMAP_THRESHOLD && size >= MMAP_THRESHOLD && align <= MAP_HEADER_SIZE)
+        return map_malloc(size); /* a mapped payload is aligned as its header is long */
+    else if (size == 0 || size > MAX_HEAP || align > MAX_HEAP)
+        return NULL;
+    if (align < MIN_BLOCK_SIZE)
+        align = MIN_BLOCK_SIZE;
+    LOCK_ARENA(HOME_ARENA());
+    ptr = heap_memalign(align, size);
+    UNLOCK_ARENA();
+    return (ptr != NULL) ? ptr : RETRY_MALLOC(HOME_ARENA(), size, align);
+}
+
+/*
+ * mm_aligned_alloc - Allocate a block whose payload is aligned to align bytes, as mm_memalign does. Returns
+ *     NULL unless align is a power of two, or if out of memory.
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0)
+        return NULL;
+    return mm_memalign(align, size);
+}
+
+/*
+ * mm_calloc - Allocate a zeroed block of nmemb elements of size bytes. A mapping comes zeroed from the system,
+ *     and so does the part of a block that the heap grew by for it and that had never been part of the heap
+ *     before; only the rest of the block is cleared, along with the footer that the free block it was carved
+ *     from left in its last word. Requests of at most CALLOC_CLEAR bytes seldom get fresh memory, and are
+ *     cleared whole.
+ *     Returns NULL if the size overflows, or if out of memory.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    char *ptr, *fresh;
+    size_t total;
+
+    if (nmemb != 0 && size > SIZE_MAX / nmemb)
+        return NULL;
+    total = nmemb * size;
+    if (MMAP_THRESHOLD && total >= MMAP_THRESHOLD)
+        return map_malloc(total);
+    else if (total <= CALLOC_CLEAR || total > MAX_HEAP) {
+        if ((ptr = mm_malloc(total)) != NULL)
+            memset(ptr, 0, total);
+        return ptr;
+    }
+    LOCK_ARENA(HOME_ARENA());
+    arena->fresh = NULL; /* set by grow_arena if the heap grows for this block */
+    ptr = heap_malloc(total);
+    fresh = arena->fresh;
+    UNLOCK_ARENA();
+    if (ptr == NULL) {
+        if ((ptr = RETRY_MALLOC(HOME_ARENA(), total, 0)) != NULL)
+            memset(ptr, 0, total);
+        return ptr;
+    } else if (fresh == NULL || ptr + total <= fresh)
+        memset(ptr, 0, total);
+    else if (ptr < fresh)
+        memset(ptr, 0, (size_t)(fresh - ptr));
+    *(word_t*)(NEXT_BLOCK(HEADER_ADDR(ptr)) - HEADER_SIZE) = 0;
+    return ptr;
+}
+
+/*
+ * mm_usable_size - Returns the number of bytes that can be used at an allocated payload, which is at least
+ *     the size it was requested with: the object size of a slab object, the payload size of a block, and the
+ *     rest of the mapping of a mapped block.
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    else if (MMAP_THRESHOLD && IS_MAPPED(ptr))
+        return MAP_LENGTH(ptr) - MAP_HEADER_SIZE;
+    else if (IS_SLAB(ptr))
+        return SLAB_OBJ_SIZE(RUN_CLASS(RUN_OF(ptr)));
+    return PAYLOAD_SIZE(HEADER_ADDR(ptr));
+}
+
+/*
+ * mm_malloc_usable - Allocate a block as mm_malloc does, and store the number of bytes that can be used at
+ *     its payload in usable unless NULL, so that a growing buffer fills what the rounding of its request
+ *     gave it before it calls mm_realloc. The usable size is 0 if out of memory.
+ */
+void *mm_malloc_usable(size_t size, size_t *usable)
+{
+    void *ptr = mm_malloc(size);
+
+    if (usable != NULL)
+        *usable = mm_usable_size(ptr);
+    return ptr;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes into ptrs, holding the lock of the arena the calling
+ *     thread is bound to once for all of them; if thread-safe, the thread cache is bypassed. Blocks that
+ *     arena has no room for come from other arenas one at a time. A batch of one block is an ordinary
+ *     request. Returns the number of blocks allocated, fewer than n only if out of memory.
+ */
+size_t mm_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    size_t count = 0;
+
+    if (n == 1 || size == 0 || size > MAX_HEAP || (MMAP_THRESHOLD && size >= MMAP_THRESHOLD)) {
+        while (count < n && (ptrs[count] = mm_malloc(size)) != NULL)
+            count++;
+        return count;
+    }
+    LOCK_ARENA(HOME_ARENA());
+    count = heap_malloc_batch(size, ptrs, n);
+    UNLOCK_ARENA();
+    while (count < n && (ptrs[count] = RETRY_MALLOC(HOME_ARENA(), size, 0)) != NULL)
+        count++;
+    return count;
+}
+
+/*
+ * mm_free_batch - Free n blocks, ignoring NULL ones, and leave ptrs sorted by address. The blocks of the
+ *     arena the calling thread is bound to are freed holding its lock once; if thread-safe, blocks of other
+ *     arenas are pushed on their remote free stacks, as mm_free does. A batch of one block is freed as
+ *     mm_free does.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    arena_t *owner;
+    size_t i, j;
+
+    if (n == 1) {
+        mm_free(ptrs[0]);
+        return;
+    }
+    sort_ptrs(ptrs, n);
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        if (ptrs[i] == NULL)
+            continue;
+        else if (MMAP_THRESHOLD && IS_MAPPED(ptrs[i])) {
+            map_free(ptrs[i]);
+            continue;
+        }
+        owner = ARENA_OF(ptrs[i]);
+#if MM_ARENAS > 1
+        if (owner != HOME_ARENA()) {
+            remote_free(owner, ptrs[i]);
+            continue;
+        }
+#endif
+        /* in address order, the blocks of an arena follow one another */
+        while (j < n && !(MMAP_THRESHOLD && IS_MAPPED(ptrs[j])) && ARENA_OF(ptrs[j]) == owner)
+            j++;
+        LOCK_ARENA(owner);
+        heap_free_batch(ptrs + i, j - i);
+        UNLOCK_ARENA();
+    }
+}
+
+/*
+ * mm_lock_all - Take the lock of every arena, and then the growth lock, in the order the package nests
+ *     them, so that no lock is held halfway through an update while another thread forks.
+ */
+void mm_lock_all(void)
+{
+#if MM_THREADS
+    int i;
+
+    for (i = 0; i < MM_ARENAS; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    LOCK_GROW();
+#endif
+}
+
+/*
+ * mm_unlock_all - Release the locks taken by mm_lock_all; in a child process too, whose only thread is
+ *     a copy of the one that took them.
+ */
+void mm_unlock_all(void)
+{
+#if MM_THREADS
+    int i;
+
+    UNLOCK_GROW();
+    for (i = MM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+#endif
+}
+
+/* 
+ * heap_malloc - Allocate a block. Small requests are served from a slab run, once enough of them are live
+ *     that a run pays for its size. Otherwise, first, round the requested size into nearest 2s power;
+ *     then, take a block freed with that size from its quick list, or search for segregated free block
+ *     list for best-fit. If none, extend the heap by at least MALLOCBUF, coalescing with the last block if
+ *     it is free, and then allocate.
+ */
+static void *heap_malloc(size_t size)
 {
     if (size == 0)
         return NULL;
+    else if (size <= SLAB_MAX && arena->slab_ready)
+        return slab_malloc(size);
 
     /* if less than MALLOCBUF, round to nearest 2's power */
     if (size < MALLOCBUF) {
@@ -166,75 +924,144 @@ void *mm_malloc(size_t size)
         size = temp;
     }
 
-    char *list, *blkptr;
-    int32_t newsize = ALIGN_FOR_BLOCK(size), bufsize;
-
-    /* search segregated free list for available free blocks, starting at appropriate list, in ascending order */
-    for (list = search_free_list(newsize); list <= first - ALIGNMENT; list = NEXT_LIST_HEADER(list)) {
-        for (blkptr = NEXT_FREE_BLOCK(list);; blkptr = NEXT_FREE_BLOCK(blkptr)) {
-            if (BLOCK_SIZE(blkptr) >= newsize) { /* found the best-fit */
-                remove_from_list(blkptr);        /* remove this block from free list */
-                split_block(blkptr, newsize);    /* split if the size is abundant */
-                return (void*)PAYLOAD_ADDR(blkptr);
-            } else if (IS_END(blkptr))
-                break;
-        }
+    char *blkptr;
+    word_t newsize = ALIGN_FOR_BLOCK(size), bufsize;
+    int index;
+
+    /* a block on the quick list of this size is still allocated and counted; it is handed out as it is */
+    STAT(mallocs, 1);
+    if (QUICK_MAX && (index = quick_class(newsize)) >= 0 && (blkptr = arena->quick[index]) != NULL) {
+        STAT(quick_hits, 1);
+        arena->quick[index] = QUICK_NEXT(blkptr);
+        arena->quick_bytes -= newsize;
+        SET_HEADER(blkptr, newsize);
+        return (void*)PAYLOAD_ADDR(blkptr);
+    }
+
+    /* if there is no suitable free block, extend the heap; if the last block is free, it is reused and */
+    /* only the missing part is requested, otherwise assign a new size that is at least MALLOCBUF       */
+    if ((blkptr = find_free_block(newsize)) == NULL) {
+        bufsize = (GET_LAST_BLOCK_IF_FREE() != NULL || newsize > MALLOCBUF) ? newsize : MALLOCBUF;
+        if ((blkptr = extend_heap(bufsize)) == NULL)
+            return NULL;
     }
+    split_block(blkptr, newsize); /* split if the size is abundant */
 
-    /* there is no suitable free block; assign a new size that is at least MALLOCBUF */
-    bufsize = newsize > MALLOCBUF ? newsize : MALLOCBUF;
-    if ((blkptr = (char*)mem_sbrk(bufsize)) == (char*)-1)
+    /* count small blocks until runs are used */
+    if (BLOCK_SIZE(blkptr) <= SMALL_BLOCK_MAX && ++arena->small_live >= SLAB_THRESHOLD)
+        arena->slab_ready = 1;
+    return (void*)PAYLOAD_ADDR(blkptr);
+}
+
+/*
+ * heap_memalign - Allocate a block whose payload is aligned to align bytes, a power of two of at least
+ *     MIN_BLOCK_SIZE, carving it out of a free block with alloc_aligned. Returns NULL if out of memory.
+ */
+static void *heap_memalign(size_t align, size_t size)
+{
+    char *blkptr = alloc_aligned(ALIGN_FOR_BLOCK(size), (word_t)align, 0);
+
+    if (blkptr == NULL)
         return NULL;
-    FREE_HEADER(blkptr, bufsize); /* set header before allocating */
-    split_block(blkptr, newsize); /* split if abundant */
+
+    /* heap_free counts small blocks down again, so this one is counted as heap_malloc would */
+    if (BLOCK_SIZE(blkptr) <= SMALL_BLOCK_MAX && ++arena->small_live >= SLAB_THRESHOLD)
+        arena->slab_ready = 1;
     return (void*)PAYLOAD_ADDR(blkptr);
 }
 
 /*
- * mm_free - Free an allocated block. Given block is assumed to be allocated by this package.
- *      coalesce if previous or next block is free block as well; then insert into free block list
+ * heap_free - Free an allocated block. Given block is assumed to be allocated by this package. A slab
+ *      object goes back to its run, and any other block to heap_free_block.
  */
-void mm_free(void *ptr)
+static void heap_free(void *ptr)
 {
     if (ptr == NULL)
         return;
+    else if (IS_SLAB(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+    heap_free_block(HEADER_ADDR(ptr));
+}
 
-    char *blkptr = HEADER_ADDR(ptr);
+/*
+ * heap_free_block - Free an allocated block that is no slab object. A block of a size heap_malloc hands
+ *      out, up to QUICK_MAX bytes, with no free neighbour to coalesce with yet, is kept allocated on its
+ *      quick list, so that the next request of that size takes it back without any list search; the quick
+ *      lists are coalesced altogether once they hold QUICK_LIMIT bytes. Any other block is coalesced right
+ *      away, so that free space next to it never waits.
+ */
+static void heap_free_block(char *blkptr)
+{
+    char *nextblkptr = NEXT_BLOCK(blkptr);
+    int index;
+
+    if (QUICK_MAX && (index = quick_class(BLOCK_SIZE(blkptr))) >= 0 && IS_SET(nextblkptr) &&
+            GET_PREV_ALLOC(blkptr)) {
+        QUICK_NEXT(blkptr) = arena->quick[index];
+        arena->quick[index] = blkptr;
+        if ((arena->quick_bytes += BLOCK_SIZE(blkptr)) >= QUICK_LIMIT)
+            flush_quick();
+        return;
+    }
+    free_block(blkptr);
+}
+
+/*
+ * free_block - Free an allocated block of the current arena: coalesce if previous or next block is free
+ *      block as well; then insert into free block list
+ */
+static void free_block(char *blkptr)
+{
     char *prevblkptr = prev_block(blkptr); /* NULL if previous block is not free */
     char *nextblkptr = NEXT_BLOCK(blkptr);
-    int32_t size = BLOCK_SIZE(blkptr);
+    word_t size = BLOCK_SIZE(blkptr);
+    char *lo = blkptr, *hi = nextblkptr; /* span whose pages may not have been released yet */
+
+    if (size <= SMALL_BLOCK_MAX)
+        arena->small_live--;
 
     /* coalesce if previous block is free */
     if (prevblkptr != NULL) {
+        STAT(coalesces, 1);
         remove_from_list(prevblkptr); /* remove from free list */
         size += BLOCK_SIZE(prevblkptr);
+        if (BLOCK_SIZE(prevblkptr) < RELEASE_THRESHOLD)
+            lo = prevblkptr;
         blkptr = prevblkptr;
     }
 
-    /* coalesce if next block is free */
-    if (IS_WITHIN_HEAP(nextblkptr) && !IS_SET(nextblkptr)) {
+    /* coalesce if next block is free; the epilogue is always marked allocated */
+    if (!IS_SET(nextblkptr)) {
+        STAT(coalesces, 1);
         remove_from_list(nextblkptr); /* remove from free list */
         size += BLOCK_SIZE(nextblkptr);
+        if (BLOCK_SIZE(nextblkptr) < RELEASE_THRESHOLD)
+            hi = NEXT_BLOCK(nextblkptr);
     }
 
     FREE_HEADER(blkptr, size);
+    KEEP_CURSOR(blkptr, size);
+    if ((TRIM_THRESHOLD && size >= TRIM_THRESHOLD) || (RELEASE_THRESHOLD && size >= RELEASE_THRESHOLD))
+        release_block(blkptr, lo, hi); /* give memory of a large free block back */
     insert_into_list(blkptr); /* insert the new free block into segregated list */
     return;
 }
 
 /*
- * mm_realloc - Reallocate an allocated block. First, round the requested size into nearest 2s power;
+ * heap_realloc - Reallocate an allocated block. First, round the requested size into nearest 2s power;
  *     then, sees if given block can handle the new size. If so, return immediately; if not, see if
  *     coalescing with previous or next block can handle the new size. If so, coalesce, NOT split, and return.
  *     If not, sees if the given block is the last block in heap; if so, just extend heap by required additional
- *     size; if not, use mm_malloc and mm_free to allocate a completely new block.
+ *     size; if not, use heap_malloc and heap_free to allocate a completely new block.
  */
-void *mm_realloc(void *ptr, size_t size)
+static void *heap_realloc(void *ptr, size_t size)
 {
     if (ptr == NULL)
-        return mm_malloc(size);
+        return heap_malloc(size);
     else if (size == 0) {
-        mm_free(ptr);
+        heap_free(ptr);
         return NULL;
     }
 
@@ -246,28 +1073,50 @@ void *mm_realloc(void *ptr, size_t size)
         size = temp;
     }
 
+    /* slab objects never grow in place; they are kept if the new size still fits their class */
+    if (IS_SLAB(ptr)) {
+        word_t objsize = SLAB_OBJ_SIZE(RUN_CLASS(RUN_OF(ptr)));
+        char *newptr;
+        if (size <= objsize)
+            return ptr;
+        if ((newptr = (char*)heap_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, objsize);
+        slab_free(ptr);
+        return newptr;
+    }
+
     char *blkptr = HEADER_ADDR(ptr);
     char *nextblkptr = NEXT_BLOCK(blkptr), *prevblkptr = prev_block(blkptr); /* NULL if previous block is not free */
-    int32_t oldsize = BLOCK_SIZE(blkptr), newsize = ALIGN_FOR_BLOCK(size), combsize, bufsize;
+    word_t oldsize = BLOCK_SIZE(blkptr), newsize = ALIGN_FOR_BLOCK(size), combsize, want;
 
     /* if rounded and aligned size fits within allocated memory, return as it is */
     if (newsize <= PAYLOAD_SIZE(blkptr)) 
         return ptr;
+
+    /* wherever the arena grows or the block moves, provision ahead if the block keeps growing */
+    want = grow_size(blkptr, newsize);
     
     /* check for different cases of reallocation */
-    if (IS_WITHIN_HEAP(nextblkptr) && !IS_SET(nextblkptr) && 
+    if (!IS_SET(nextblkptr) && 
             ((combsize = BLOCK_SIZE(nextblkptr) + oldsize) >= newsize)) {
         /* next block is free and combined size can contain the new size; coalesce and return */
         remove_from_list(nextblkptr);
         SET_HEADER(blkptr, combsize);
-    } else if (IS_WITHIN_HEAP(nextblkptr) && !IS_SET(nextblkptr) && 
+    } else if (!IS_SET(nextblkptr) && NEXT_BLOCK(nextblkptr) == arena->top &&
+            grow_arena(ALIGN_FOR_BLOCK(want - oldsize - BLOCK_SIZE(nextblkptr)), 0) != NULL) {
+        /* next block is free and the last block in memory; the arena has grown in place by what the two */
+        /* blocks lack, and they are coalesced without moving the payload                               */
+        remove_from_list(nextblkptr);
+        SET_HEADER(blkptr, (word_t)(arena->top - blkptr));
+    } else if (!IS_SET(nextblkptr) && 
             prevblkptr != NULL && BLOCK_SIZE(prevblkptr) > REALLOCBUF &&
             ((combsize = BLOCK_SIZE(prevblkptr) + oldsize + BLOCK_SIZE(nextblkptr)) >= newsize)) {
         /* previous block and next block are free, they can altogether contain the new size, and */
         /* the previous block is at least as large as REALLOCBUF; coalesce and return            */
         remove_from_list(prevblkptr);
         remove_from_list(nextblkptr);
-        memmove(prevblkptr, blkptr, oldsize); /* using memmove for safety over overlapping memory */
+        memmove(PAYLOAD_ADDR(prevblkptr), ptr, oldsize - HEADER_SIZE); /* memmove for overlapping memory */
         blkptr = prevblkptr;
         SET_HEADER(blkptr, combsize);
     } else if (prevblkptr != NULL && (BLOCK_SIZE(prevblkptr) > REALLOCBUF) &&
@@ -275,39 +1124,192 @@ void *mm_realloc(void *ptr, size_t size)
         /* previous block is free, the combined size can contain the new size, and the previous block */
         /* is at least as REALLOCBUF (to prevent further external fragmentation); coalesce and return */
         remove_from_list(prevblkptr);
-        memmove(prevblkptr, blkptr, oldsize); /* using memmove for safety over overlapping memory */
+        memmove(PAYLOAD_ADDR(prevblkptr), ptr, oldsize - HEADER_SIZE); /* memmove for overlapping memory */
         blkptr = prevblkptr;
         SET_HEADER(blkptr, combsize);
-    } else if (!IS_WITHIN_HEAP(nextblkptr)) {
-        /* none of above case holds, but the given block is the last block in memory */
-        bufsize = ALIGN_FOR_BLOCK(newsize - oldsize);
-        if (mem_sbrk(bufsize) == (void*)-1)
-            return NULL;
-        SET_HEADER(blkptr, oldsize + bufsize);
+    } else if (nextblkptr == arena->top &&
+            grow_arena(ALIGN_FOR_BLOCK(want - oldsize), 0) != NULL) {
+        /* none of above case holds, but the given block is the last block in memory; the arena has */
+        /* grown in place by the required additional size                                          */
+        SET_HEADER(blkptr, (word_t)(arena->top - blkptr));
+    } else if (QUICK_MAX && arena->quick_bytes != 0) {
+        /* none of above case holds, but a neighbour may be waiting on a quick list; coalesce all of */
+        /* them and try again before moving the block                                              */
+        flush_quick();
+        return heap_realloc(ptr, size);
     } else {
-        /* none of above case holds; just allocate a memory block */
-        if ((nextblkptr = (char*)mm_malloc(newsize)) == NULL)
+        /* none of above case holds; just allocate a memory block, at the same offset within a page if it */
+        /* is large enough that mem_move remaps its pages instead of copying them                         */
+        if (REMAP_THRESHOLD && oldsize >= REMAP_THRESHOLD) {
+            word_t page = (word_t)mem_pagesize();
+            if ((nextblkptr = alloc_aligned(want, page, (word_t)((uintptr_t)ptr & (page - 1)))) == NULL)
+                return NULL;
+            nextblkptr = PAYLOAD_ADDR(nextblkptr);
+        } else if ((nextblkptr = (char*)heap_malloc(want)) == NULL)
             return NULL;
-        memcpy(nextblkptr, ptr, PAYLOAD_SIZE(blkptr));
-        mm_free(ptr);
+        mem_move(nextblkptr, ptr, PAYLOAD_SIZE(blkptr));
+        heap_free(ptr);
+        if (IS_SLAB(nextblkptr))
+            return nextblkptr;
         blkptr = HEADER_ADDR(nextblkptr);
     }
+    KEEP_CURSOR(blkptr, BLOCK_SIZE(blkptr));
+    SET_GROWN(blkptr);
     return (void*)PAYLOAD_ADDR(blkptr);
 }
 
 
 
+/*
+ * heap_malloc_batch - Allocate n blocks of a size into ptrs. Slab objects, and blocks waiting on the quick
+ *     list of the size, are taken one at a time as heap_malloc does; the rest are carved one after another
+ *     off the front of a single free block that holds all of them, or of the heap extended by all of them,
+ *     and what is left of that block goes back to a list. Returns the number of blocks allocated.
+ */
+static size_t heap_malloc_batch(size_t size, void **ptrs, size_t n)
+{
+    char *blkptr;
+    word_t newsize, want, rest, bufsize;
+    size_t count = 0, k;
+    int index;
+
+    if (size == 0)
+        return 0;
+
+    /* if less than MALLOCBUF, round to nearest 2's power */
+    newsize = size;
+    if (size < MALLOCBUF) {
+        newsize = 1;
+        while (newsize < size)
+            newsize <<= 1;
+    }
+    newsize = ALIGN_FOR_BLOCK(newsize);
+
+    index = QUICK_MAX ? quick_class(newsize) : -1;
+    while (count < n && ((size <= SLAB_MAX && arena->slab_ready) || (index >= 0 && arena->quick[index] != NULL))) {
+        if ((ptrs[count] = heap_malloc(size)) == NULL)
+            return count;
+        count++;
+    }
+
+    while (count < n) {
+        k = (n - count < MAX_HEAP / newsize) ? n - count : MAX_HEAP / newsize;
+        want = (word_t)(k * newsize);
+        if ((blkptr = find_free_block(want)) == NULL) {
+            bufsize = (GET_LAST_BLOCK_IF_FREE() != NULL || want > MALLOCBUF) ? want : MALLOCBUF;
+            if ((blkptr = extend_heap(bufsize)) == NULL)
+                break;
+        }
+
+        /* carve blocks off the front; the last one takes the rest if it is too little to split off */
+        rest = BLOCK_SIZE(blkptr);
+        while (count < n && rest >= newsize) {
+            bufsize = (rest - newsize < MIN_BLOCK_SIZE) ? rest : newsize;
+            STAT(mallocs, 1);
+            SET_HEADER(blkptr, bufsize);
+            if (bufsize <= SMALL_BLOCK_MAX && ++arena->small_live >= SLAB_THRESHOLD)
+                arena->slab_ready = 1;
+            ptrs[count++] = PAYLOAD_ADDR(blkptr);
+            blkptr += bufsize;
+            rest -= bufsize;
+        }
+        if (rest != 0) {
+            STAT(splits, 1);
+            FREE_HEADER(blkptr, rest);
+            insert_into_list(blkptr);
+        }
+    }
+
+    /* out of memory for the rest at once; some may still fit one at a time */
+    while (count < n && (ptrs[count] = heap_malloc(size)) != NULL)
+        count++;
+    return count;
+}
+
+/*
+ * heap_free_batch - Free n blocks of the current arena, sorted by address. Blocks that follow one another
+ *     in the heap are merged first, so that the merged block is coalesced with its neighbours and inserted
+ *     into a list only once; a block with no freed neighbour is freed as heap_free does.
+ */
+static void heap_free_batch(void **ptrs, size_t n)
+{
+    char *blkptr, *nextblkptr;
+    word_t size;
+    size_t i, j;
+
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        if (IS_SLAB(ptrs[i])) {
+            slab_free(ptrs[i]);
+            continue;
+        }
+
+        /* merge the blocks that follow, counting small blocks down as free_block does for the merged one */
+        blkptr = HEADER_ADDR(ptrs[i]);
+        size = BLOCK_SIZE(blkptr);
+        while (j < n && (char*)ptrs[j] == PAYLOAD_ADDR(blkptr + size)) {
+            nextblkptr = HEADER_ADDR(ptrs[j++]);
+            if (BLOCK_SIZE(nextblkptr) <= SMALL_BLOCK_MAX)
+                arena->small_live--;
+            size += BLOCK_SIZE(nextblkptr);
+        }
+        if (j == i + 1) {
+            heap_free(ptrs[i]);
+            continue;
+        }
+        if (BLOCK_SIZE(blkptr) <= SMALL_BLOCK_MAX && size > SMALL_BLOCK_MAX)
+            arena->small_live--;
+        STAT(coalesces, j - i - 1);
+        SET_HEADER(blkptr, size);
+        free_block(blkptr);
+    }
+}
+
+
+
 /********************
  * Helper Functions *
  ********************/
 
+/*
+ * sort_ptrs - Sort n pointers by address: by insertion if there are at most SORT_SMALL, since batches are
+ *     mostly short, and with qsort otherwise.
+ */
+static void sort_ptrs(void **ptrs, size_t n)
+{
+    void *ptr;
+    size_t i, j;
+
+    if (n > SORT_SMALL) {
+        qsort(ptrs, n, sizeof(void*), compare_ptrs);
+        return;
+    }
+    for (i = 1; i < n; i++) {
+        ptr = ptrs[i];
+        for (j = i; j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)ptr; j--)
+            ptrs[j] = ptrs[j - 1];
+        ptrs[j] = ptr;
+    }
+}
+
+/*
+ * compare_ptrs - Order two pointers by address, for qsort.
+ */
+static int compare_ptrs(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void* const*)a, y = (uintptr_t)*(void* const*)b;
+
+    return (x > y) - (x < y);
+}
+
  /*
   * split_block - Allocate a free block with new size, and split if abundant
   */
-static void split_block(char *blkptr, int32_t newsize) {
+static void split_block(char *blkptr, word_t newsize) {
     char *newblkptr;
-    int32_t oldsize = BLOCK_SIZE(blkptr);
-    if (newsize < oldsize - ALIGNMENT) { /* there is enough space to split the block */
+    word_t oldsize = BLOCK_SIZE(blkptr);
+    if (oldsize - newsize >= MIN_BLOCK_SIZE) { /* there is enough space to split the block */
+        STAT(splits, 1);
         SET_HEADER(blkptr, newsize);
         newblkptr = NEXT_BLOCK(blkptr);
         FREE_HEADER(newblkptr, oldsize - newsize); /* set header for split block */
@@ -317,58 +1319,333 @@ static void split_block(char *blkptr, int32_t newsize) {
 }
 
 /*
- * prev_block - Return the previous block if it is free; NULL otherwise.
+ * find_free_block - Search segregated free lists for the best-fit block of given size, and remove it from
+ *     its list. If there is none, the quick lists are coalesced, and the blocks other threads have freed to
+ *     the arena since it was locked are freed, and the lists are searched once more, so that the arena only
+ *     grows once those are used up. Returns NULL if there is still none.
  */
-static char *prev_block(char *blkptr)
+static char *find_free_block(word_t size)
 {
-    char *list;
-    char *tempblkptr;
-    char *prevblk_footer = blkptr - HEADER_SIZE;
-    char *prevblk_header = blkptr - BLOCK_SIZE(prevblk_footer);
-
-    /* prevblk_footer and prevblk_header are retrieved assuming that the previous block to         */
-    /* blkptr is a free block; that is, it contains a footer information. Now, it must be checked  */
-    /* whether this assumption is true: is the previous block free? is previous block within heap? */
-    /* is previous block header and footer appropriately distanced? is the previous block header   */
-    /* abiding by alignment requirement? is the header and the footer contain same data?           */
-    /* checking in that order, returning NULL if any of conditions not hold                        */
-    if (IS_SET(prevblk_footer) ||
-        prevblk_header < first ||
-        prevblk_header > prevblk_footer - HEADER_SIZE * 3 ||
-        (uint32_t)(prevblk_header + HEADER_SIZE) % ALIGNMENT != 0 ||
-        BLOCK_SIZE(prevblk_header) != BLOCK_SIZE(prevblk_footer) ||
-        IS_SET(prevblk_header))
-        return NULL;
-    
-    /* finally, check if the block is officially a free block by looking into segregated list */
-    list = search_free_list(BLOCK_SIZE(prevblk_header));
-    for (tempblkptr = NEXT_FREE_BLOCK(list);; tempblkptr = NEXT_FREE_BLOCK(tempblkptr)) {
-        if (prevblk_header == tempblkptr)
-            return prevblk_header; /* block exists in free list; return the block */
-        else if (IS_END(tempblkptr))
-            break;
-    }
+    char *blkptr;
+    uint32_t avail = arena->list_bitmap & (~0u << size_class(size)); /* non-empty lists that may fit */
 
+    /* search segregated free list for available free blocks, starting at appropriate list, in ascending  */
+    /* order; empty lists are skipped by jumping to the lowest set bit of the remaining occupancy bitmap */
+    for (; avail != 0; avail &= avail - 1) {
+        STAT(lists_probed, 1);
+        if ((blkptr = find_fit(__builtin_ctz(avail), size)) != NULL) { /* found the best-fit */
+            remove_from_list(blkptr); /* remove this block from free list */
+            return blkptr;
+        }
+    }
+    if (QUICK_MAX && arena->quick_bytes != 0) {
+        flush_quick();
+        return find_free_block(size);
+    }
+    if (DRAIN_REMOTE())
+        return find_free_block(size);
     return NULL;
 }
 
+/*
+ * quick_class - Returns the quick list of blocks of given size, or -1 if heap_malloc never hands out a
+ *     block of that size for a request of at most QUICK_MAX bytes.
+ */
+static int quick_class(word_t size)
+{
+    int index = WORD_MSB(size - HEADER_SIZE);
+
+    return ((word_t)1 << index <= QUICK_MAX && ALIGN_FOR_BLOCK((word_t)1 << index) == size) ? index : -1;
+}
+
+/*
+ * flush_quick - Coalesce every block on the quick lists of the current arena, and insert them into free
+ *     block lists.
+ */
+static void flush_quick(void)
+{
+    char *blkptr;
+    int i;
+
+    STAT(quick_flushes, 1);
+    arena->quick_bytes = 0;
+    for (i = 0; i < QUICK_CLASSES; i++) {
+        while ((blkptr = arena->quick[i]) != NULL) {
+            arena->quick[i] = QUICK_NEXT(blkptr);
+            free_block(blkptr);
+        }
+    }
+}
+
+/*
+ * extend_heap - Extend the arena so that it ends with a free block of at least given size, coalescing with
+ *     the last block if it is free. Returns that block, which is not in any free list; NULL if out of memory.
+ */
+static char *extend_heap(word_t size)
+{
+    char *blkptr = GET_LAST_BLOCK_IF_FREE();
+    char *epilogue = arena->top; /* new space begins at the old epilogue, unless a new chunk is started */
+    word_t lastsize = (blkptr != NULL) ? BLOCK_SIZE(blkptr) : 0;
+
+    if (size > lastsize) {
+        if ((epilogue = grow_arena(size - lastsize, size)) == NULL)
+            return NULL;
+        if (blkptr != NULL && epilogue != NEXT_BLOCK(blkptr))
+            blkptr = NULL; /* the free last block stays behind in the old chunk */
+    }
+    if (blkptr != NULL)
+        remove_from_list(blkptr); /* coalesce with the free last block */
+    else
+        blkptr = epilogue;
+    FREE_HEADER(blkptr, (word_t)(arena->top - blkptr)); /* set header before allocating */
+    return blkptr;
+}
+
+/*
+ * grow_arena - Get at least size more bytes for the arena from the memlib heap, and set up its new epilogue.
+ *     If the last chunk of the arena ends at the top of the heap, it grows in place, and its old epilogue is
+ *     returned. Otherwise, unless fresh is 0, a new chunk is started: a word holding the owner arena, then a
+ *     block of at least fresh bytes behind an allocated fence, whose header is returned. A new chunk begins at
+ *     the next ARENA_PAGE boundary, so that no page holds blocks of two arenas, and it spans at least
+ *     ARENA_CHUNK bytes up to a page boundary, so that one chunk serves many requests and its last page is
+ *     not left as padding in front of the next chunk; the free rest past fresh bytes is split off onto a
+ *     free list. Only as much as the heap has room for is taken, as long as that still holds fresh bytes.
+ *     Returns NULL if out of memory, or if fresh is 0 and the arena cannot grow in place. The part of the
+ *     new space that had never been part of the heap before, and reads as zero, starts at the fresh pointer
+ *     of the arena.
+ */
+static char *grow_arena(word_t size, word_t fresh)
+{
+    char *brk, *chunk, *start;
+    word_t need, room;
+
+    LOCK_GROW();
+    brk = (char*)mem_heap_hi() + 1;
+    if (arena->top != NULL && arena->top + HEADER_SIZE == brk) {
+        chunk = brk;
+        start = arena->top; /* the old epilogue becomes the header of the new space */
+    } else if (fresh != 0) {
+        chunk = brk + ARENA_PAD(brk);
+        start = chunk + HEADER_SIZE;
+        size = (word_t)(chunk - brk) + fresh + (HEADER_SIZE << 1);
+    } else {
+        UNLOCK_GROW();
+        return NULL;
+    }
+    need = size;
+    if (start != arena->top) {
+        if (size < (word_t)(chunk - brk) + ARENA_CHUNK)
+            size = (word_t)(chunk - brk) + ARENA_CHUNK;
+        size += ARENA_PAD(brk + size);
+    }
+    room = (word_t)(MAX_HEAP - mem_heapsize());
+    if (size > room && need <= room)
+        size = room; /* the heap is nearly full; take what is left rather than fail */
+    arena->fresh = (char*)mem_heap_fresh(); /* the heap only grows under the growth lock */
+    if (size > INT_MAX || mem_sbrk((int)size) == (void*)-1) { /* memlib grows by less than 2 GB at a time */
+        UNLOCK_GROW();
+        return NULL;
+    }
+    STAT(sbrks, 1);
+    STAT(sbrk_bytes, size);
+    if (start != arena->top) {
+        *(word_t*)chunk = (word_t)(arena - arenas);
+        *(word_t*)start = PREV_ALLOC;
+    }
+#if MM_ARENAS > 1
+    memset(arena_map + PAGE_INDEX(chunk), (int)(arena - arenas), PAGE_INDEX(brk + size - 1) - PAGE_INDEX(chunk) + 1);
+#endif
+    arena->top = brk + size - HEADER_SIZE;
+    SET_EPILOGUE(arena->top);
+    UNLOCK_GROW();
+    return start;
+}
+
+/*
+ * release_block - Give memory of a large free block, which is in no list, back to the system. If it is the
+ *     last block of the heap and at least TRIM_THRESHOLD bytes, the heap shrinks so that MALLOCBUF bytes of
+ *     it remain; only the arena whose chunk ends at the top of the heap can do so. Then, if the block is at
+ *     least RELEASE_THRESHOLD bytes, the pages between lo and hi behind its free block metadata are released;
+ *     the rest of the block came from free blocks that large, whose pages were released before.
+ */
+static void release_block(char *blkptr, char *lo, char *hi)
+{
+    word_t size = BLOCK_SIZE(blkptr), shrink = size - (MALLOCBUF);
+    uintptr_t page;
+
+    if (TRIM_THRESHOLD && size >= TRIM_THRESHOLD && NEXT_BLOCK(blkptr) == arena->top) {
+        LOCK_GROW();
+        if (arena->top + HEADER_SIZE == (char*)mem_heap_hi() + 1 && shrink <= INT_MAX &&
+                mem_sbrk(-(int)shrink) != (void*)-1) {
+            arena->top -= shrink;
+            SET_EPILOGUE(arena->top);
+            size -= shrink;
+            FREE_HEADER(blkptr, size);
+            STAT(sbrks, 1);
+            STAT(trim_bytes, shrink);
+        }
+        UNLOCK_GROW();
+    }
+    if (RELEASE_THRESHOLD && size >= RELEASE_THRESHOLD) {
+        /* widen the span to whole pages, which the rest of the block may share, unless they hold metadata */
+        page = (uintptr_t)mem_pagesize();
+        lo = (char*)((uintptr_t)lo & ~(page - 1));
+        hi = (char*)(((uintptr_t)hi + page - 1) & ~(page - 1));
+        lo = (lo > blkptr + (HEADER_SIZE << 2)) ? lo : blkptr + (HEADER_SIZE << 2);
+        hi = (hi < blkptr + size - HEADER_SIZE) ? hi : blkptr + size - HEADER_SIZE;
+        if (lo < hi)
+            mem_release(lo, hi - lo);
+    }
+}
+
+/*
+ * grow_size - Returns the size to provision for given allocated block that realloc grows to newsize. A
+ *     block grown for the first time gets exactly newsize; one grown before is likely to keep growing, and
+ *     gets ahead of it by 1/2^GROW_SHIFT of its size, but by at most 2^GROW_STEPS times the current
+ *     growth and GROW_MAX bytes, so that the slack stays small next to a block that stops growing.
+ */
+static word_t grow_size(char *blkptr, word_t newsize)
+{
+    word_t growth = newsize - PAYLOAD_SIZE(blkptr), extra;
+
+    if (!IS_GROWN(blkptr))
+        return newsize;
+    extra = BLOCK_SIZE(blkptr) >> GROW_SHIFT;
+    if (extra > growth << GROW_STEPS)
+        extra = growth << GROW_STEPS;
+    if (extra > GROW_MAX)
+        extra = GROW_MAX;
+    return newsize + (extra & SIZEMASK);
+}
+
+/*
+ * align_pad - Returns the size of the leading free block that must be split off so that the payload of
+ *     given block lies offset bytes past a multiple of align bytes; it is either 0 or large enough to be a
+ *     block by itself.
+ */
+static word_t align_pad(char *blkptr, word_t align, word_t offset)
+{
+    word_t pad = (word_t)(((uintptr_t)offset - (uintptr_t)PAYLOAD_ADDR(blkptr)) & (uintptr_t)(align - 1));
+    return (pad == 0 || pad >= MIN_BLOCK_SIZE) ? pad : pad + align;
+}
+
+/*
+ * alloc_aligned - Allocate a block of given size whose payload lies offset bytes, a multiple of ALIGNMENT,
+ *     past a multiple of align bytes, which is a power of two not less than MIN_BLOCK_SIZE. The misaligned
+ *     leading part of the free block that is used is split off and returned to free list. Returns NULL if
+ *     out of memory.
+ */
+static char *alloc_aligned(word_t newsize, word_t align, word_t offset)
+{
+    char *blkptr;
+    word_t oldsize, pad;
+
+    /* any block this large can hold an aligned block after the largest possible pad; if there is none, */
+    /* extend the heap just enough that an aligned block ends at the new epilogue                       */
+    if ((blkptr = find_free_block(newsize + MAX_ALIGN_PAD(align))) == NULL) {
+        if ((blkptr = GET_LAST_BLOCK_IF_FREE()) == NULL)
+            blkptr = arena->top;
+        pad = (blkptr != NULL) ? align_pad(blkptr, align, offset) : MAX_ALIGN_PAD(align);
+        if ((blkptr = extend_heap(pad + newsize)) == NULL)
+            return NULL;
+
+        /* a new chunk may need a larger pad than predicted; then grow it once more by the worst case */
+        if (BLOCK_SIZE(blkptr) < align_pad(blkptr, align, offset) + newsize) {
+            insert_into_list(blkptr);
+            if ((blkptr = extend_heap(newsize + MAX_ALIGN_PAD(align))) == NULL)
+                return NULL;
+        }
+    }
+
+    /* split off the leading part, which follows an allocated block, as a separate free block */
+    if ((pad = align_pad(blkptr, align, offset)) != 0) {
+        oldsize = BLOCK_SIZE(blkptr);
+        FREE_HEADER(blkptr, pad);
+        insert_into_list(blkptr);
+        blkptr += pad;
+        FREE_HEADER(blkptr, oldsize - pad);
+    }
+    split_block(blkptr, newsize); /* split if the size is abundant */
+    return blkptr;
+}
+
+/*
+ * prev_block - Return the previous block if it is free; NULL otherwise.
+ */
+static char *prev_block(char *blkptr)
+{
+    /* the previous block has a valid footer only if it is free, which is recorded in this header */
+    STAT(prev_lookups, 1);
+    if (GET_PREV_ALLOC(blkptr))
+        return NULL;
+    STAT(prev_free, 1);
+    return blkptr - BLOCK_SIZE(blkptr - HEADER_SIZE);
+}
+
+/*
+ * size_class - Returns index of the segregated list that best-fits given size
+ */
+static int size_class(word_t size)
+{
+#ifdef SIZE_CLASSES
+    /* the table classes sizes below SIZE_CLASS_MAX; from there on, list SIZE_CLASS_SMALL + i holds sizes */
+    /* in [2^i, 2^(i+1)) times SIZE_CLASS_MAX, and anything that overfits the lists goes to the last one  */
+    int index;
+    if (size < SIZE_CLASS_MAX)
+        return size_class_table[size / ALIGNMENT];
+    index = SIZE_CLASS_SMALL + WORD_MSB(size) - WORD_MSB(SIZE_CLASS_MAX);
+#else
+    /* list i holds sizes in [2^(i+4), 2^(i+5)), except list 0 which also holds anything smaller; */
+    /* if size overfits any of the lists, it goes to the very last list                          */
+    int index = WORD_MSB(size) - 4;
+    if (index < 0)
+        return 0;
+#endif
+    return index < LIST_TOTAL ? index : LIST_TOTAL - 1;
+}
+
 /*
  * search_free_list - Returns head to a free list among segregated lists that best-fits given size
  */
-static char *search_free_list(int32_t size) 
+static char *search_free_list(word_t size) 
 {   
-    char *list = head;
-    int order = size >> 4;
-    int list_num = 1;
+    return LIST_HEADER(size_class(size));
+}
+
+/*
+ * find_fit - Returns the smallest block in given segregated list that can hold given size; NULL if none.
+ *     The list is walked from whichever end is nearer in size, so the largest block, at its tail, also
+ *     tells at once if none fits.
+ */
+static char *find_fit(int index, word_t size)
+{
+    char *list = LIST_HEADER(index);
+    char *blkptr, *tail;
+
+    if (IS_TREE_CLASS(index))
+        return tree_best_fit(list, size);
 
-    /* repeat until given size fits within range defined by "order." Order will begin at 16,   */
-    /* and increase exponentially; if size overfits any of the order, go to the very last list */
-    while (order > 1 && list_num < LIST_TOTAL) {
-        order >>= 1;
-        list_num++;
-        list = NEXT_LIST_HEADER(list);
+    /* list is in ascending order, so the first block that fits is the best-fit */
+    blkptr = NEXT_FREE_BLOCK(list);
+    tail = LIST_TAIL(list);
+    STAT(search_hops, 1);
+    if (BLOCK_SIZE(blkptr) >= size)
+        return blkptr;
+    STAT(search_hops, blkptr != tail);
+    if (BLOCK_SIZE(tail) < size)
+        return NULL;
+
+    if (size - BLOCK_SIZE(blkptr) < BLOCK_SIZE(tail) - size) {
+        do {
+            STAT(search_hops, 1);
+            blkptr = NEXT_FREE_BLOCK(blkptr);
+        } while (BLOCK_SIZE(blkptr) < size);
+        return blkptr;
     }
-    return list;
+    /* nearer the tail: walk back while the previous block still fits; the first block does not */
+    for (blkptr = tail; BLOCK_SIZE(PREV_FREE_BLOCK(blkptr)) >= size; blkptr = PREV_FREE_BLOCK(blkptr))
+        STAT(search_hops, 1);
+    return blkptr;
 }
 
 /*
@@ -376,37 +1653,60 @@ static char *search_free_list(int32_t size)
  */
 static void insert_into_list(char *blkptr)
 {
-    /* first, find the list that best-fits block's size */
-    char *list = search_free_list(BLOCK_SIZE(blkptr));
-
-    /* if there is a free block in this list, insert by ascending order */
-    if (!IS_END(list)) {
-        while (1) {
-            /* insert when the block not greater than next block, or */
-            /* there is no more block in the list                    */
-            if (BLOCK_SIZE(NEXT_FREE_BLOCK(list)) >= BLOCK_SIZE(blkptr)) {
-                /* found the appropriate position */
-                SET_NEXT_FREE_BLOCK(blkptr, NEXT_FREE_BLOCK(list));
-                SET_PREV_FREE_BLOCK(NEXT_FREE_BLOCK(list), blkptr);
-                SET_NEXT_FREE_BLOCK(list, blkptr);
-                SET_PREV_FREE_BLOCK(blkptr, list);
-                return;
-            } else if (IS_END(NEXT_FREE_BLOCK(list))) {
-                /* there is no more block to compare to */
-                SET_NEXT_FREE_BLOCK(NEXT_FREE_BLOCK(list), blkptr);
-                SET_NEXT_FREE_BLOCK(blkptr, blkptr);
-                SET_PREV_FREE_BLOCK(blkptr, NEXT_FREE_BLOCK(list));
-                return;
-            }
-            /* none of above condition holds; go to next item in the list */
-            list = NEXT_FREE_BLOCK(list);
-        }
-    } else { /* there is no free block in this list; just insert as its first item */
+    /* first, find the list that best-fits block's size, and mark it non-empty */
+    int index = size_class(BLOCK_SIZE(blkptr));
+    char *list = LIST_HEADER(index);
+    char *next, *tail, *prevblkptr;
+    word_t size;
+    arena->list_bitmap |= 1u << index;
+    arena->touched = blkptr;
+    STAT(inserts, 1);
+
+    /* large blocks are kept in a tree instead */
+    if (IS_TREE_CLASS(index)) {
+        tree_insert(list, blkptr);
+        return;
+    }
+
+    /* there is no free block in this list; just insert as its first and last item */
+    if (IS_END(list)) {
         SET_NEXT_FREE_BLOCK(list, blkptr);
         SET_NEXT_FREE_BLOCK(blkptr, blkptr);
         SET_PREV_FREE_BLOCK(blkptr, list);
+        SET_LIST_TAIL(list, blkptr);
         return;
     }
+
+    /* the block goes in front of the first block not smaller than it; walk from the end nearer in */
+    /* size to that block, which is next                                                           */
+    size = BLOCK_SIZE(blkptr);
+    next = NEXT_FREE_BLOCK(list);
+    tail = LIST_TAIL(list);
+    STAT(insert_hops, 1);
+    if (BLOCK_SIZE(next) < size) {
+        STAT(insert_hops, next != tail);
+        if (BLOCK_SIZE(tail) < size) { /* there is no block to compare to after the tail */
+            SET_NEXT_FREE_BLOCK(tail, blkptr);
+            SET_NEXT_FREE_BLOCK(blkptr, blkptr);
+            SET_PREV_FREE_BLOCK(blkptr, tail);
+            SET_LIST_TAIL(list, blkptr);
+            return;
+        }
+        if (size - BLOCK_SIZE(next) < BLOCK_SIZE(tail) - size) {
+            do {
+                STAT(insert_hops, 1);
+                next = NEXT_FREE_BLOCK(next);
+            } while (BLOCK_SIZE(next) < size);
+        } else {
+            for (next = tail; BLOCK_SIZE(PREV_FREE_BLOCK(next)) >= size; next = PREV_FREE_BLOCK(next))
+                STAT(insert_hops, 1);
+        }
+    }
+    prevblkptr = PREV_FREE_BLOCK(next);
+    SET_NEXT_FREE_BLOCK(blkptr, next);
+    SET_PREV_FREE_BLOCK(next, blkptr);
+    SET_NEXT_FREE_BLOCK(prevblkptr, blkptr);
+    SET_PREV_FREE_BLOCK(blkptr, prevblkptr);
 }
 
 /*
@@ -414,11 +1714,28 @@ static void insert_into_list(char *blkptr)
  */
 static void remove_from_list(char *blkptr)
 {
-    char *prevblkptr = PREV_FREE_BLOCK(blkptr);
-    char *nextblkptr = NEXT_FREE_BLOCK(blkptr);
-    if (IS_END(blkptr)) /* if at the end of free list, just fix the previous block */
+    char *prevblkptr, *nextblkptr;
+    int index = size_class(BLOCK_SIZE(blkptr));
+
+    if (arena->touched == blkptr)
+        arena->touched = NULL;
+
+    /* large blocks are kept in a tree instead */
+    if (IS_TREE_CLASS(index)) {
+        tree_remove(LIST_HEADER(index), blkptr);
+        if (IS_END(LIST_HEADER(index))) /* the tree became empty */
+            arena->list_bitmap &= ~(1u << index);
+        return;
+    }
+
+    prevblkptr = PREV_FREE_BLOCK(blkptr);
+    nextblkptr = NEXT_FREE_BLOCK(blkptr);
+    if (IS_END(blkptr)) { /* if at the end of free list, just fix the previous block, the new tail */
         SET_NEXT_FREE_BLOCK(prevblkptr, prevblkptr);
-    else { /* if in the middle of free list, connect previous and next free blocks */
+        SET_LIST_TAIL(LIST_HEADER(index), prevblkptr);
+        if (IS_LIST_HEADER(prevblkptr)) /* the list became empty */
+            arena->list_bitmap &= ~(1u << LIST_INDEX(prevblkptr));
+    } else { /* if in the middle of free list, connect previous and next free blocks */
         SET_NEXT_FREE_BLOCK(prevblkptr, nextblkptr);
         SET_PREV_FREE_BLOCK(nextblkptr, prevblkptr);
     }
@@ -426,15 +1743,764 @@ static void remove_from_list(char *blkptr)
 }
 
 
+/*
+ * rotate_left - Rotates the subtree at node to the left, so that its right child takes its place.
+ */
+static void rotate_left(char *list, char *node)
+{
+    char *child = RIGHT(node);
+    char *grandchild = LEFT(child);
+
+    SET_RIGHT(node, grandchild);
+    if (grandchild != NULL)
+        SET_PARENT(grandchild, node);
+    tree_replace(list, node, child);
+    SET_LEFT(child, node);
+    SET_PARENT(node, child);
+}
+
+/*
+ * rotate_right - Rotates the subtree at node to the right, so that its left child takes its place.
+ */
+static void rotate_right(char *list, char *node)
+{
+    char *child = LEFT(node);
+    char *grandchild = RIGHT(child);
+
+    SET_LEFT(node, grandchild);
+    if (grandchild != NULL)
+        SET_PARENT(grandchild, node);
+    tree_replace(list, node, child);
+    SET_RIGHT(child, node);
+    SET_PARENT(node, child);
+}
+
+/*
+ * tree_replace - Links child (possibly NULL) to the parent of node in place of node.
+ */
+static void tree_replace(char *list, char *node, char *child)
+{
+    char *parent = PARENT(node);
+
+    if (parent == NULL)
+        SET_TREE_ROOT(list, child);
+    else if (LEFT(parent) == node)
+        SET_LEFT(parent, child);
+    else
+        SET_RIGHT(parent, child);
+    if (child != NULL)
+        SET_PARENT(child, parent);
+}
+
+/*
+ * tree_insert - Inserts a new free block into the tree at given list head, and rebalances.
+ */
+static void tree_insert(char *list, char *node)
+{
+    char *parent = NULL, *grandparent, *uncle, *cur = TREE_ROOT(list);
+
+    /* find the leaf position by size and address, and attach node there as a red leaf */
+    while (cur != NULL) {
+        STAT(insert_hops, 1);
+        parent = cur;
+        cur = KEY_LESS(node, cur) ? LEFT(cur) : RIGHT(cur);
+    }
+    LEFT_VAL(node) = 0;
+    RIGHT_VAL(node) = 0;
+    PARENT_VAL(node) = TREE_OFFSET(node, parent) | RED;
+    if (parent == NULL)
+        SET_TREE_ROOT(list, node);
+    else if (KEY_LESS(node, parent))
+        SET_LEFT(parent, node);
+    else
+        SET_RIGHT(parent, node);
+
+    /* resolve red node with red parent; the parent is not the root, so grandparent exists */
+    for (parent = PARENT(node); IS_RED(parent); parent = PARENT(node)) {
+        grandparent = PARENT(parent);
+        if (parent == LEFT(grandparent)) {
+            uncle = RIGHT(grandparent);
+            if (IS_RED(uncle)) { /* recolor and continue from grandparent */
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grandparent);
+                node = grandparent;
+                continue;
+            }
+            if (node == RIGHT(parent)) { /* make node an outer grandchild first */
+                rotate_left(list, parent);
+                node = parent;
+                parent = PARENT(node);
+            }
+            SET_BLACK(parent);
+            SET_RED(grandparent);
+            rotate_right(list, grandparent);
+        } else { /* mirror image of above */
+            uncle = LEFT(grandparent);
+            if (IS_RED(uncle)) {
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grandparent);
+                node = grandparent;
+                continue;
+            }
+            if (node == LEFT(parent)) {
+                rotate_right(list, parent);
+                node = parent;
+                parent = PARENT(node);
+            }
+            SET_BLACK(parent);
+            SET_RED(grandparent);
+            rotate_left(list, grandparent);
+        }
+    }
+    SET_BLACK(TREE_ROOT(list));
+}
+
+/*
+ * tree_remove - Removes a free block from the tree at given list head, and rebalances.
+ */
+static void tree_remove(char *list, char *node)
+{
+    char *child, *parent, *successor, *sibling;
+    int removed_red;
+
+    if (LEFT(node) == NULL || RIGHT(node) == NULL) {
+        /* node has at most one child, which takes its place */
+        child = LEFT(node) != NULL ? LEFT(node) : RIGHT(node);
+        parent = PARENT(node);
+        removed_red = IS_RED(node);
+        tree_replace(list, node, child);
+    } else {
+        /* node has two children; its successor is unlinked instead, and then takes its place and color */
+        for (successor = RIGHT(node); LEFT(successor) != NULL; successor = LEFT(successor));
+        child = RIGHT(successor);
+        removed_red = IS_RED(successor);
+        if (PARENT(successor) == node)
+            parent = successor;
+        else {
+            parent = PARENT(successor);
+            tree_replace(list, successor, child);
+            SET_RIGHT(successor, RIGHT(node));
+            SET_PARENT(RIGHT(successor), successor);
+        }
+        tree_replace(list, node, successor);
+        SET_LEFT(successor, LEFT(node));
+        SET_PARENT(LEFT(successor), successor);
+        if (IS_RED(node))
+            SET_RED(successor);
+        else
+            SET_BLACK(successor);
+    }
+    if (removed_red)
+        return;
+
+    /* child (possibly NULL) under parent lacks one black node; push the deficit up or fix it by rotation */
+    while (child != TREE_ROOT(list) && !IS_RED(child)) {
+        if (child == LEFT(parent)) {
+            sibling = RIGHT(parent);
+            if (IS_RED(sibling)) {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                rotate_left(list, parent);
+                sibling = RIGHT(parent);
+            }
+            if (!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling))) {
+                SET_RED(sibling);
+                child = parent;
+                parent = PARENT(child);
+                continue;
+            }
+            if (!IS_RED(RIGHT(sibling))) {
+                SET_BLACK(LEFT(sibling));
+                SET_RED(sibling);
+                rotate_right(list, sibling);
+                sibling = RIGHT(parent);
+            }
+            if (IS_RED(parent))
+                SET_RED(sibling);
+            else
+                SET_BLACK(sibling);
+            SET_BLACK(parent);
+            SET_BLACK(RIGHT(sibling));
+            rotate_left(list, parent);
+        } else { /* mirror image of above */
+            sibling = LEFT(parent);
+            if (IS_RED(sibling)) {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                rotate_right(list, parent);
+                sibling = LEFT(parent);
+            }
+            if (!IS_RED(LEFT(sibling)) && !IS_RED(RIGHT(sibling))) {
+                SET_RED(sibling);
+                child = parent;
+                parent = PARENT(child);
+                continue;
+            }
+            if (!IS_RED(LEFT(sibling))) {
+                SET_BLACK(RIGHT(sibling));
+                SET_RED(sibling);
+                rotate_left(list, sibling);
+                sibling = LEFT(parent);
+            }
+            if (IS_RED(parent))
+                SET_RED(sibling);
+            else
+                SET_BLACK(sibling);
+            SET_BLACK(parent);
+            SET_BLACK(LEFT(sibling));
+            rotate_right(list, parent);
+        }
+        child = TREE_ROOT(list);
+        break;
+    }
+    if (child != NULL)
+        SET_BLACK(child);
+}
+
+/*
+ * tree_best_fit - Returns the smallest (lowest addressed among equals) block in tree that can hold size.
+ */
+static char *tree_best_fit(char *list, word_t size)
+{
+    char *node = TREE_ROOT(list), *fit = NULL;
+
+    while (node != NULL) {
+        STAT(search_hops, 1);
+        if (BLOCK_SIZE(node) >= size) { /* candidate; look for a smaller one on the left */
+            fit = node;
+            node = LEFT(node);
+        } else
+            node = RIGHT(node);
+    }
+    return fit;
+}
+
+/*
+ * tree_next - Returns the block following node in size and address order, or the first block if node is NULL.
+ */
+static char *tree_next(char *list, char *node)
+{
+    char *parent;
+
+    /* the leftmost node of the right subtree, or of the whole tree */
+    if (node == NULL || RIGHT(node) != NULL) {
+        node = (node == NULL) ? TREE_ROOT(list) : RIGHT(node);
+        if (node != NULL)
+            while (LEFT(node) != NULL)
+                node = LEFT(node);
+        return node;
+    }
+
+    /* otherwise, the first ancestor whose left subtree contains node */
+    for (parent = PARENT(node); parent != NULL && node == RIGHT(parent); parent = PARENT(node))
+        node = parent;
+    return parent;
+}
+
+/*
+ * tree_contains - Returns 1 if given block is in the tree at given list head, and 0 otherwise.
+ */
+static int tree_contains(char *list, char *node)
+{
+    char *cur = TREE_ROOT(list);
+
+    while (cur != NULL && cur != node)
+        cur = KEY_LESS(node, cur) ? LEFT(cur) : RIGHT(cur);
+    return cur != NULL;
+}
+
+
+
+
+/*****************************
+ * Slab Allocation Functions *
+ *****************************/
+
+/*
+ * slab_malloc - Allocate an object from the first run of its slab class with room, creating a run if none.
+ */
+static void *slab_malloc(size_t size)
+{
+    int cls = SLAB_CLASS(size);
+    char *run = arena->slab_runs[cls], *obj;
+
+    if (run == NULL && (run = new_run(cls)) == NULL)
+        return NULL;
+
+    /* reuse a freed object if any; otherwise, hand out the next never used object */
+    if (RUN_FREE(run) != 0) {
+        obj = run + RUN_FREE(run);
+        RUN_FREE(run) = *(int32_t*)obj;
+    } else {
+        obj = run + RUN_BUMP(run);
+        RUN_BUMP(run) += SLAB_OBJ_SIZE(cls);
+    }
+
+    /* a full run leaves the list of runs with room */
+    if (--RUN_NFREE(run) == 0)
+        unlink_run(run);
+    return (void*)obj;
+}
+
+/*
+ * slab_free - Return an object to its run. A run that regains room is put at front of its class, and a
+ *     run that becomes empty is released to the heap unless it is the only run of its class with room.
+ */
+static void slab_free(char *ptr)
+{
+    char *run = RUN_OF(ptr);
+    int cls = RUN_CLASS(run);
+
+    *(int32_t*)ptr = RUN_FREE(run);
+    RUN_FREE(run) = (int32_t)(ptr - run);
+
+    if (RUN_NFREE(run)++ == 0) { /* run was full; put it at front of its class */
+        RUN_PREV_VAL(run) = 0;
+        RUN_NEXT_VAL(run) = (arena->slab_runs[cls] != NULL) ? (word_t)(arena->slab_runs[cls] - run) : 0;
+        if (arena->slab_runs[cls] != NULL)
+            RUN_PREV_VAL(arena->slab_runs[cls]) = (word_t)(run - arena->slab_runs[cls]);
+        arena->slab_runs[cls] = run;
+    } else if (RUN_NFREE(run) == RUN_CAPACITY(cls) && (arena->slab_runs[cls] != run || RUN_NEXT(run) != NULL)) {
+        /* run is empty and another run has room; release it as an ordinary block */
+        unlink_run(run);
+        CLEAR_SLAB(run);
+        heap_free(run);
+    }
+}
+
+/*
+ * new_run - Allocate a RUN_SIZE-aligned block, set it up as an empty run of given slab class, and put it
+ *     at front of its class. Returns NULL if out of memory.
+ */
+static char *new_run(int cls)
+{
+    char *blkptr, *run;
+
+    if ((blkptr = alloc_aligned(ALIGN_FOR_BLOCK(RUN_SIZE), RUN_SIZE, 0)) == NULL)
+        return NULL;
+    run = PAYLOAD_ADDR(blkptr);
+    RUN_CLASS(run) = cls;
+    RUN_NFREE(run) = RUN_CAPACITY(cls);
+    RUN_FREE(run) = 0;
+    RUN_BUMP(run) = RUN_HEADER_SIZE;
+    RUN_PREV_VAL(run) = 0;
+    RUN_NEXT_VAL(run) = (arena->slab_runs[cls] != NULL) ? (word_t)(arena->slab_runs[cls] - run) : 0;
+    if (arena->slab_runs[cls] != NULL)
+        RUN_PREV_VAL(arena->slab_runs[cls]) = (word_t)(run - arena->slab_runs[cls]);
+    arena->slab_runs[cls] = run;
+    SET_SLAB(run);
+    return run;
+}
+
+/*
+ * unlink_run - Remove a run from the list of runs with room of its slab class.
+ */
+static void unlink_run(char *run)
+{
+    char *prevrun = RUN_PREV(run), *nextrun = RUN_NEXT(run);
+
+    if (prevrun != NULL)
+        RUN_NEXT_VAL(prevrun) = (nextrun != NULL) ? (word_t)(nextrun - prevrun) : 0;
+    else
+        arena->slab_runs[RUN_CLASS(run)] = nextrun;
+    if (nextrun != NULL)
+        RUN_PREV_VAL(nextrun) = (prevrun != NULL) ? (word_t)(prevrun - nextrun) : 0;
+}
+
+
+
+/**************************
+ * Mapped Block Functions *
+ **************************/
+
+/*
+ * map_length - Returns the length of the mapping that holds a payload of given size behind its header; 0 if
+ *     it would overflow.
+ */
+static size_t map_length(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > SIZE_MAX - MAP_HEADER_SIZE - page)
+        return 0;
+    return (size + MAP_HEADER_SIZE + page - 1) & ~(page - 1);
+}
+
+/*
+ * map_malloc - Allocate a block in a mapping of its own, whose header holds the length of the mapping.
+ *     No lock is needed. Returns NULL if out of memory.
+ */
+static void *map_malloc(size_t size)
+{
+    size_t len = map_length(size);
+    char *start;
+
+    if (len == 0 || (start = (char*)mem_map(len)) == NULL)
+        return NULL;
+    *(size_t*)start = len;
+    return start + MAP_HEADER_SIZE;
+}
+
+/*
+ * map_realloc - Reallocate a mapped block. If it still reaches MMAP_THRESHOLD bytes, the mapping is resized
+ *     with mem_remap, which moves its pages instead of copying them; otherwise the block moves back to the
+ *     heap. Returns NULL if out of memory, leaving the block untouched.
+ */
+static void *map_realloc(void *ptr, size_t size)
+{
+    size_t len = map_length(size);
+    char *start;
+    void *newptr;
+
+    if (size < MMAP_THRESHOLD) {
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, size);
+        map_free(ptr);
+        return newptr;
+    }
+    if (len == MAP_LENGTH(ptr))
+        return ptr;
+    if (len == 0 || (start = (char*)mem_remap(MAP_START(ptr), MAP_LENGTH(ptr), len)) == NULL)
+        return NULL;
+    *(size_t*)start = len;
+    return start + MAP_HEADER_SIZE;
+}
+
+/*
+ * map_free - Free a mapped block by unmapping it.
+ */
+static void map_free(void *ptr)
+{
+    mem_unmap(MAP_START(ptr), MAP_LENGTH(ptr));
+}
+
+
+
+#if MM_THREADS
+/*******************
+ * Arena Functions *
+ *******************/
+
+/*
+ * lock_arena - Lock given arena and make it current, then free the blocks other threads have queued for it.
+ */
+static void lock_arena(arena_t *a)
+{
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+    drain_remote();
+}
+
+/*
+ * drain_remote - Take the whole remote free stack of the current arena at once, and free its blocks. Only
+ *     the holder of the arena lock pops, and never a single block, so the stack is free of ABA problems.
+ *     Returns the number of blocks freed.
+ */
+static int drain_remote(void)
+{
+    char *blk, *next;
+    unsigned count = 0;
+
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL)
+        return 0;
+    for (blk = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE); blk != NULL; blk = next) {
+        next = REMOTE_NEXT(blk);
+        heap_free(blk);
+        count++;
+    }
+    __atomic_fetch_sub(&arena->remote_count, count, __ATOMIC_RELAXED);
+    return (int)count;
+}
+
+/*
+ * remote_free - Push a block on the remote free stack of its arena with a single compare-and-swap. Every
+ *     REMOTE_THRESHOLD pushes, the arena is drained right away if its lock can be taken without waiting.
+ */
+static void remote_free(arena_t *owner, void *ptr)
+{
+    char *blk = (char*)ptr, *top = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    arena_t *current = arena;
+
+    do {
+        REMOTE_NEXT_VAL(blk) = (top != NULL) ? (word_t)(top - blk) : 0;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &top, blk, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(&owner->remote_count, 1, __ATOMIC_RELAXED) % REMOTE_THRESHOLD == 0 &&
+            pthread_mutex_trylock(&owner->lock) == 0) {
+        arena = owner;
+        drain_remote();
+        pthread_mutex_unlock(&owner->lock);
+        arena = current;
+    }
+}
+
+/*
+ * free_to_owner - Free a block held by a thread that has locked its own arena: directly if the block belongs
+ *     to that arena, and through the remote free stack of its owner otherwise.
+ */
+static void free_to_owner(void *ptr)
+{
+    arena_t *owner = ARENA_OF(ptr);
+
+    if (owner == arena)
+        heap_free(ptr);
+    else
+        remote_free(owner, ptr);
+}
+
+#if MM_ARENAS > 1
+/*
+ * retry_malloc - Allocate a block from another arena than tried, once tried has no fit and the heap no room
+ *     for it to grow; aligned by heap_memalign to align bytes unless align is 0. Every page of the heap may
+ *     belong to arenas whose threads are done with it, so each other arena is tried in turn, holding its
+ *     lock; the block goes back to it when freed. No arena lock may be held. Returns NULL if no arena has
+ *     room either.
+ */
+static void *retry_malloc(arena_t *tried, size_t size, size_t align)
+{
+    arena_t *a;
+    void *ptr = NULL;
+
+    for (a = arenas; a < arenas + MM_ARENAS && ptr == NULL; a++) {
+        if (a == tried)
+            continue;
+        LOCK_ARENA(a);
+        ptr = (align != 0) ? heap_memalign(align, size) : heap_malloc(size);
+        UNLOCK_ARENA();
+    }
+    return ptr;
+}
+#endif
+
+
+
+/**************************
+ * Thread Cache Functions *
+ **************************/
+
+/*
+ * tcache_bin - Returns the bin of a request of at most TCACHE_MAX bytes: one per slab class, and then one
+ *     per power of two.
+ */
+static int tcache_bin(size_t size)
+{
+    if (size <= SLAB_MAX)
+        return SLAB_CLASS(size);
+    return SLAB_CLASSES + (31 - __builtin_clz((uint32_t)size - 1)) - __builtin_ctz(SLAB_MAX);
+}
+
+/*
+ * tcache_usable_bin - Returns the last bin whose every request fits in given allocated block, or
+ *     TCACHE_BINS if the block is too large to be cached. This is read without any arena lock, since other
+ *     threads only change the PREV_ALLOC flag of an allocated header, and never unmark a run in use.
+ */
+static int tcache_usable_bin(void *ptr)
+{
+    word_t usable = IS_SLAB(ptr) ? SLAB_OBJ_SIZE(RUN_CLASS(RUN_OF(ptr))) : PAYLOAD_SIZE(HEADER_ADDR(ptr));
+
+    if (usable < (SLAB_MAX << 1))
+        return (usable < SLAB_MAX ? usable : SLAB_MAX) / ALIGNMENT - 1;
+    usable = SLAB_CLASSES + WORD_MSB(usable) - __builtin_ctz(SLAB_MAX) - 1;
+    return usable < TCACHE_BINS ? usable : TCACHE_BINS;
+}
+
+/*
+ * tcache_get - Returns the cache of the calling thread. If it belongs to an older heap, it is emptied first,
+ *     and the thread is bound to the next arena in round-robin order.
+ */
+static tcache_t *tcache_get(void)
+{
+    if (tcache.generation != heap_generation) {
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.generation = heap_generation;
+        tcache.home = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % MM_ARENAS];
+        pthread_once(&tcache_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    return &tcache;
+}
+
+/*
+ * tcache_malloc - Allocate a block from the bin of given size, refilling the bin with TCACHE_BATCH blocks
+ *     from the arena of the thread under its lock if it is empty. Returns NULL if out of memory.
+ */
+static void *tcache_malloc(size_t size)
+{
+    tcache_t *tc = tcache_get();
+    int bin = tcache_bin(size);
+    size_t binsize = (bin < SLAB_CLASSES) ? SLAB_OBJ_SIZE(bin) : SLAB_MAX << (bin - SLAB_CLASSES + 1);
+    void *ptr;
+
+    if (tc->count[bin] == 0) {
+        LOCK_ARENA(tc->home);
+        while (tc->count[bin] < TCACHE_BATCH && (ptr = heap_malloc(binsize)) != NULL) {
+            TCACHE_NEXT(ptr) = tc->bins[bin];
+            tc->bins[bin] = ptr;
+            tc->count[bin]++;
+        }
+        UNLOCK_ARENA();
+        if (tc->count[bin] == 0)
+            return RETRY_MALLOC(tc->home, binsize, 0);
+    }
+    ptr = tc->bins[bin];
+    tc->bins[bin] = TCACHE_NEXT(ptr);
+    tc->count[bin]--;
+    return ptr;
+}
+
+/*
+ * tcache_free - Keep given block in the cache of the calling thread, flushing TCACHE_BATCH blocks of its
+ *     bin to their arenas if the bin is full. Returns 0 if the block is too large to be cached.
+ */
+static int tcache_free(void *ptr)
+{
+    tcache_t *tc;
+    int bin = tcache_usable_bin(ptr), i;
+    void *blk;
+
+    if (bin == TCACHE_BINS)
+        return 0;
+    tc = tcache_get();
+    if (tc->count[bin] == TCACHE_COUNT) {
+        LOCK_ARENA(tc->home);
+        for (i = 0; i < TCACHE_BATCH; i++) {
+            blk = tc->bins[bin];
+            tc->bins[bin] = TCACHE_NEXT(blk);
+            free_to_owner(blk);
+        }
+        UNLOCK_ARENA();
+        tc->count[bin] -= TCACHE_BATCH;
+    }
+    TCACHE_NEXT(ptr) = tc->bins[bin];
+    tc->bins[bin] = ptr;
+    tc->count[bin]++;
+    return 1;
+}
+
+/*
+ * tcache_make_key - Create the key whose destructor flushes the cache of an exiting thread.
+ */
+static void tcache_make_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * tcache_release - Return every block of an exiting thread's cache to its arena, unless the heap it
+ *     belongs to has been reinitialized since.
+ */
+static void tcache_release(void *arg)
+{
+    tcache_t *tc = (tcache_t*)arg;
+    void *blk;
+    int bin;
+
+    if (tc->generation == heap_generation) {
+        LOCK_ARENA(tc->home);
+        for (bin = 0; bin < TCACHE_BINS; bin++) {
+            while ((blk = tc->bins[bin]) != NULL) {
+                tc->bins[bin] = TCACHE_NEXT(blk);
+                free_to_owner(blk);
+            }
+        }
+        UNLOCK_ARENA();
+    }
+    memset(tc, 0, sizeof(*tc));
+}
+#endif
+
+
+
+/*******************
+ * Heap Statistics *
+ *******************/
+
+/*
+ * mm_heap_stats - Fill in given stats with the event counts of every arena added up, and the shape of the
+ *     heap: the size of the heap, and the free blocks on every list, by list. Free objects of slab runs and
+ *     blocks cached by threads are part of allocated blocks, and blocks on quick lists are counted apart.
+ *     No other thread may use the package meanwhile.
+ */
+void mm_heap_stats(mm_stats_t *stats)
+{
+    arena_t *saved = arena;
+    char *list, *blkptr;
+    int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->heap_size = mem_heapsize();
+    for (i = 0; i < MM_ARENAS; i++) {
+        arena = &arenas[i];
+#if MM_STATS
+        stats->mallocs += arena->stats.mallocs;
+        stats->lists_probed += arena->stats.lists_probed;
+        stats->search_hops += arena->stats.search_hops;
+        stats->inserts += arena->stats.inserts;
+        stats->insert_hops += arena->stats.insert_hops;
+        stats->prev_lookups += arena->stats.prev_lookups;
+        stats->prev_free += arena->stats.prev_free;
+        stats->splits += arena->stats.splits;
+        stats->coalesces += arena->stats.coalesces;
+        stats->quick_hits += arena->stats.quick_hits;
+        stats->quick_flushes += arena->stats.quick_flushes;
+        stats->sbrks += arena->stats.sbrks;
+        stats->sbrk_bytes += arena->stats.sbrk_bytes;
+        stats->trim_bytes += arena->stats.trim_bytes;
+#endif
+        stats->quick_bytes += arena->quick_bytes;
+        for (j = 0; j < LIST_TOTAL; j++) {
+            list = LIST_HEADER(j);
+            if (IS_END(list))
+                continue;
+            blkptr = IS_TREE_CLASS(j) ? tree_next(list, NULL) : NEXT_FREE_BLOCK(list);
+            while (blkptr != NULL) {
+                stats->class_blocks[j]++;
+                stats->class_bytes[j] += BLOCK_SIZE(blkptr);
+                if (BLOCK_SIZE(blkptr) > stats->largest_free)
+                    stats->largest_free = BLOCK_SIZE(blkptr);
+                if (IS_TREE_CLASS(j))
+                    blkptr = tree_next(list, blkptr);
+                else
+                    blkptr = IS_END(blkptr) ? NULL : NEXT_FREE_BLOCK(blkptr);
+            }
+            stats->free_blocks += stats->class_blocks[j];
+            stats->free_bytes += stats->class_bytes[j];
+        }
+    }
+    arena = saved;
+}
+
+
 
 /***************************
  * Heap Consistency Cheker *
  ***************************/
 
 /*
- * mm_check - Checks for heap consistency. Returns 0 if inconsistent, and 1 otherwise.
+ * mm_check - Checks for heap consistency of every arena. Returns 0 if inconsistent, and 1 otherwise.
+ *     No other thread may use the package meanwhile.
  */
 int mm_check(void)
+{
+    arena_t *saved = arena;
+    int i, ok = 1;
+
+    for (i = 0; i < MM_ARENAS && ok; i++) {
+        arena = &arenas[i];
+        ok = check_arena();
+    }
+    arena = saved;
+    return ok;
+}
+
+/*
+ * check_arena - Checks for consistency of the lists of the current arena, and of every block in heap.
+ *     Returns 0 if inconsistent, and 1 otherwise.
+ */
+static int check_arena(void)
 {
     /*
      * Options - Change these values to check for different cases
@@ -446,6 +2512,11 @@ int mm_check(void)
     int checkFreeBlockCoalesce = 1;      /* check if every continuous free blocks are coalesced */
     int checkAllFreeBlockInFreeList = 1; /* check if every free block is in free list */
     int checkFreeBlockFooter = 1;        /* check if free blocks have appropriate footers */
+    int checkPrevAllocFlag = 1;          /* check if every header records status of its previous block */
+    int checkListBitmap = 1;             /* check if occupancy bitmap matches non-empty free lists */
+    int checkFreeTree = 1;               /* check if best-fit trees are ordered and balanced */
+    int checkSlabRuns = 1;               /* check if slab runs with room are marked and count free objects */
+    int checkQuickLists = 1;             /* check if quick lists hold allocated blocks of their sizes */
     int checkOverlap = 1;                /* check if any of blocks overlap */
     int checkWithinHeap = 1;             /* check if every block is within heap */
     /*
@@ -464,10 +2535,10 @@ int mm_check(void)
         j = 1;
         if (verbose)
             printf("\n\n\n____________________ALL BLOCKS_______________________\n");
-        for (blkptr = first; blkptr < (char*)mem_heap_hi(); blkptr = NEXT_BLOCK(blkptr)) {
+        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr)) {
             if (verbose)
-                printf("Block #%d: [%p] %d Bytes (%s)\n", 
-                    i++, blkptr, BLOCK_SIZE(blkptr), IS_SET(blkptr) ? "Set" : "FREE");
+                printf("Block #%d: [%p] %ld Bytes (%s)\n", 
+                    i++, blkptr, (long)BLOCK_SIZE(blkptr), IS_SET(blkptr) ? "Set" : "FREE");
         }
     }
 
@@ -477,13 +2548,21 @@ int mm_check(void)
         j = 1;
         if (verbose)
             printf("\n\n____________________FREE LISTS_______________________\n\n");
-        for (list = head; list <= first - ALIGNMENT; list = NEXT_LIST_HEADER(list)) {
+        for (list = arena->head; list <= LIST_HEADER(LIST_TOTAL - 1); list = NEXT_LIST_HEADER(list)) {
             if (verbose)
                 printf("LIST %d[%p]:\n", i++, list);
+            if (IS_TREE_CLASS(LIST_INDEX(list))) { /* print tree in size and address order */
+                for (blkptr = tree_next(list, NULL); blkptr != NULL; blkptr = tree_next(list, blkptr))
+                    if (verbose)
+                        printf("  Block #%d: [%p] %ld Bytes (%s, %s)\n", j++, blkptr, (long)BLOCK_SIZE(blkptr),
+                            IS_SET(blkptr) ? "Set" : "FREE", IS_RED(blkptr) ? "red" : "black");
+                j = 1;
+                continue;
+            }
             for (blkptr = NEXT_FREE_BLOCK(list);; blkptr = NEXT_FREE_BLOCK(blkptr)) {
                 if (verbose)
-                    printf("  Block #%d: [%p] %d Bytes (%s)\n", 
-                        j++, blkptr, BLOCK_SIZE(blkptr), IS_SET(blkptr) ? "Set" : "FREE");
+                    printf("  Block #%d: [%p] %ld Bytes (%s)\n", 
+                        j++, blkptr, (long)BLOCK_SIZE(blkptr), IS_SET(blkptr) ? "Set" : "FREE");
                 if (IS_END(blkptr))
                     break;
             }
@@ -493,9 +2572,17 @@ int mm_check(void)
 
     /* check if every free block in segregated free block list are marked free in its header */
 	if (checkFreeListMarks) {
-        list = head;
+        list = arena->head;
         for (i = 0; i < LIST_TOTAL; i++) {
-            if (!IS_END(list)) {
+            if (IS_TREE_CLASS(i)) {
+                for (blkptr = tree_next(list, NULL); blkptr != NULL; blkptr = tree_next(list, blkptr)) {
+                    if (IS_SET(blkptr)) { /* there is a block in free tree that is marked allocated */
+                        if (verbose)
+                            printf("checkFreeListMarks failed\n");
+                        return 0;
+                    }
+                }
+            } else if (!IS_END(list)) {
                 for (blkptr = NEXT_FREE_BLOCK(list);; blkptr = NEXT_FREE_BLOCK(blkptr)) {
                     if (IS_SET(blkptr)){ /* there is a block in free list that is marked allocated */
                         if (verbose)
@@ -514,7 +2601,7 @@ int mm_check(void)
 
     /* check if there exist any cases of continuous free blocks */
     if (checkFreeBlockCoalesce) {
-        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = NEXT_BLOCK(blkptr)) {
+        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr)) {
             if (IS_WITHIN_HEAP(NEXT_BLOCK(blkptr)) && !IS_SET(blkptr) && !IS_SET(NEXT_BLOCK(blkptr))) {
                 /* there is a consecutive sequence of free blocks */
                 if (verbose)
@@ -528,11 +2615,19 @@ int mm_check(void)
 
     /* check if every free block is in fact in the free list */
     if (checkAllFreeBlockInFreeList) {
-        list = head;
+        list = arena->head;
         for (i = 0; i < LIST_TOTAL; i++) {
-            for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = NEXT_BLOCK(blkptr)) {
-                if (!IS_SET(blkptr)) {
+            for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr)) {
+                if (!IS_SET(blkptr) && ARENA_OF(blkptr) == arena) {
                     templist = search_free_list(BLOCK_SIZE(blkptr)); /* search for free list that this block belongs to */
+                    if (IS_TREE_CLASS(LIST_INDEX(templist))) {
+                        if (!tree_contains(templist, blkptr)) { /* block is not in the free tree */
+                            if (verbose)
+                                printf("checkAllFreeBlockInFreeList failed\n");
+                            return 0;
+                        }
+                        continue;
+                    }
                     for (tempblk = NEXT_FREE_BLOCK(templist);; tempblk = NEXT_FREE_BLOCK(tempblk)) {
                         if (blkptr == tempblk) /* block is in the free list; no error */
                             break;
@@ -551,9 +2646,9 @@ int mm_check(void)
 
     /* check if every free block has good footer (only free blocks have footer in this implementation) */
     if (checkFreeBlockFooter) {
-        list = head;
+        list = arena->head;
         for (i = 0; i < LIST_TOTAL; i++) {
-            for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = NEXT_BLOCK(blkptr)) {
+            for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr)) {
                 if (!IS_SET(blkptr)) {
                     tempblk = blkptr + BLOCK_SIZE(blkptr) - HEADER_SIZE; /* get footer */
                     if (IS_SET(tempblk) || BLOCK_SIZE(tempblk) != BLOCK_SIZE(blkptr)) { 
@@ -569,9 +2664,98 @@ int mm_check(void)
             printf("checkFreeBlockFooter passed\n");
     }
 
+    /* check if bit i of the occupancy bitmap is set exactly when segregated list i is non-empty */
+    if (checkListBitmap) {
+        for (i = 0; i < LIST_TOTAL; i++) {
+            if (!(arena->list_bitmap & (1u << i)) != IS_END(LIST_HEADER(i))) {
+                if (verbose)
+                    printf("checkListBitmap failed\n");
+                return 0;
+            }
+        }
+        if (verbose)
+            printf("checkListBitmap passed\n");
+    }
+
+    /* check if every best-fit tree has consistent links, size and address order, and red-black balance */
+    if (checkFreeTree) {
+        for (i = TREE_CLASS; i < LIST_TOTAL; i++) {
+            blkptr = TREE_ROOT(LIST_HEADER(i));
+            if (IS_RED(blkptr) || check_tree(blkptr, NULL, NULL, NULL, i) < 0) {
+                if (verbose)
+                    printf("checkFreeTree failed\n");
+                return 0;
+            }
+        }
+        if (verbose)
+            printf("checkFreeTree passed\n");
+    }
+
+    /* check if every run with room is marked in page bitmap, belongs to its class, links back to the */
+    /* previous run, and has as many free objects as its freed and never used objects altogether      */
+    if (checkSlabRuns) {
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            for (list = NULL, blkptr = arena->slab_runs[i]; blkptr != NULL; list = blkptr, blkptr = RUN_NEXT(blkptr)) {
+                j = RUN_CAPACITY(i) - (RUN_BUMP(blkptr) - RUN_HEADER_SIZE) / SLAB_OBJ_SIZE(i);
+                for (tempblk = blkptr + RUN_FREE(blkptr); tempblk != blkptr && j <= RUN_CAPACITY(i);
+                        tempblk = blkptr + *(int32_t*)tempblk)
+                    j++;
+                if (!IS_SLAB(blkptr) || RUN_CLASS(blkptr) != i || RUN_PREV(blkptr) != list ||
+                        RUN_NFREE(blkptr) <= 0 || RUN_NFREE(blkptr) != j) {
+                    if (verbose)
+                        printf("checkSlabRuns failed\n");
+                    return 0;
+                }
+            }
+        }
+        if (verbose)
+            printf("checkSlabRuns passed\n");
+    }
+
+    /* check if every block on a quick list is an allocated block of the arena within heap, of the size of */
+    /* its list, and if the sizes add up to the count of bytes on quick lists                             */
+    if (checkQuickLists) {
+        word_t bytes = 0;
+        for (i = 0; i < QUICK_CLASSES; i++) {
+            for (blkptr = arena->quick[i]; blkptr != NULL; blkptr = QUICK_NEXT(blkptr)) {
+                if (blkptr < first || !IS_WITHIN_HEAP(blkptr) || ARENA_OF(blkptr) != arena ||
+                        !IS_SET(blkptr) || quick_class(BLOCK_SIZE(blkptr)) != i) {
+                    if (verbose)
+                        printf("checkQuickLists failed\n");
+                    return 0;
+                }
+                bytes += BLOCK_SIZE(blkptr);
+            }
+        }
+        if (bytes != arena->quick_bytes) {
+            if (verbose)
+                printf("checkQuickLists failed\n");
+            return 0;
+        }
+        if (verbose)
+            printf("checkQuickLists passed\n");
+    }
+
+    /* check if every header, including the epilogues, correctly marks whether the previous block is allocated; */
+    /* the first block of a chunk follows an allocated fence                                                  */
+    if (checkPrevAllocFlag) {
+        for (blkptr = first, tempblk = NULL; IS_WITHIN_HEAP(blkptr);
+                tempblk = blkptr, blkptr = next_heap_block(blkptr)) {
+            i = (tempblk == NULL || NEXT_BLOCK(tempblk) != blkptr) ? 1 : IS_SET(tempblk);
+            if (!GET_PREV_ALLOC(blkptr) != !i || !GET_PREV_ALLOC(NEXT_BLOCK(blkptr)) != !IS_SET(blkptr)) {
+                /* flag does not match the actual status of the previous block */
+                if (verbose)
+                    printf("checkPrevAllocFlag failed\n");
+                return 0;
+            }
+        }
+        if (verbose)
+            printf("checkPrevAllocFlag passed\n");
+    }
+
     /* check if no blocks overlap in the heap; THIS DOES NOT CHECK every case of overlap as it is done by mdriver */
     if (checkOverlap) {
-        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = NEXT_BLOCK(blkptr)) {
+        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr)) {
             if (IS_WITHIN_HEAP(NEXT_BLOCK(blkptr)) && NEXT_BLOCK(blkptr) < blkptr + HEADER_SIZE * 3) {
                 /* this block is not the last block in heap, yet the next block position is awkward */
                 if (verbose)
@@ -585,8 +2769,8 @@ int mm_check(void)
 
     /* check if every block is within heap */
 	if (checkWithinHeap) {
-        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = NEXT_BLOCK(blkptr));
-        if (blkptr != (char*)mem_heap_hi() + 1) {
+        for (blkptr = first; IS_WITHIN_HEAP(blkptr); blkptr = next_heap_block(blkptr));
+        if (blkptr != EPILOGUE_ADDR()) {
             /* swiped through all the blocks until it exceeds heap, yet the destination position is awkward */
             if (verbose)
                 printf("checkWithinHeap failed\n");
@@ -600,4 +2784,231 @@ int mm_check(void)
     if (verbose)
 	    printf("**mm_check has found no error**\n\n");
     return 1;
-}
\ No newline at end of file
+}
+
+/*
+ * mm_check_step - Checks a bounded slice of the heap, cheap enough to run after every request: the next
+ *     CHECK_SLICE blocks from where the previous call stopped, starting over at the end of the heap; the
+ *     free block last inserted in each arena; and, unless ptr is NULL, the payload ptr that the package
+ *     just returned with the blocks around it. Free blocks are checked against their list or tree
+ *     neighbours too. Only one arena is locked at a time: the one owning ptr, then the one owning the
+ *     slice, then each other arena whose lock is free, so that the checker may run in every thread.
+ *     Returns 0 if inconsistent, printing why, and 1 otherwise.
+ */
+int mm_check_step(void *ptr)
+{
+    arena_t *saved = arena;
+    char *blkptr;
+    int i, ok = 1;
+
+    /* a payload just returned stays allocated, and owned by its arena, until the caller frees it */
+    if (ptr != NULL && !(MMAP_THRESHOLD && IS_MAPPED(ptr))) {
+        if (!IS_BLOCK_ADDR(HEADER_ADDR(ptr))) {
+            printf("mm_check_step failed: payload [%p] is not within heap\n", ptr);
+            ok = 0;
+        } else {
+            LOCK_ARENA(ARENA_OF(ptr));
+            ok = check_payload(ptr);
+            UNLOCK_ARENA();
+        }
+    }
+
+    if (ok)
+        ok = check_slice();
+
+    /* a free block last inserted stays free until it is removed from its list; a busy arena is skipped */
+    for (i = 0; i < MM_ARENAS && ok; i++) {
+        if (!TRYLOCK_ARENA(&arenas[i]))
+            continue;
+        blkptr = arena->touched;
+        if (blkptr != NULL && (!IS_BLOCK_ADDR(blkptr) || IS_SET(blkptr))) {
+            printf("mm_check_step failed: block [%p] last inserted is not a free block\n", blkptr);
+            ok = 0;
+        } else if (blkptr != NULL)
+            ok = check_block(blkptr);
+        UNLOCK_ARENA();
+    }
+
+    arena = saved;
+    return ok;
+}
+
+/*
+ * check_slice - Checks the next CHECK_SLICE blocks from the cursor, holding the lock of the arena owning
+ *     them, and moves the cursor past them. The walk stops at the end of a chunk, since the next chunk may
+ *     belong to another arena; the cursor then moves to the next chunk under the growth lock, which every
+ *     new chunk is set up under. If another thread moves the cursor first, the slice is left to it.
+ *     Returns 0 if inconsistent, printing why, and 1 otherwise.
+ */
+static int check_slice(void)
+{
+    arena_t *owner;
+    char *cursor = GET_CURSOR(), *blkptr;
+    int i, ok = 1;
+
+    blkptr = (cursor != NULL && IS_BLOCK_ADDR(cursor)) ? cursor : first;
+    owner = ARENA_OF(blkptr);
+    LOCK_ARENA(owner);
+    if (GET_CURSOR() != cursor || !IS_BLOCK_ADDR(blkptr) || ARENA_OF(blkptr) != owner) {
+        UNLOCK_ARENA();
+        return 1;
+    }
+    for (i = 0; i < CHECK_SLICE && (ok = check_block(blkptr)); i++) {
+        if (IS_EPILOGUE(NEXT_BLOCK(blkptr))) {
+            LOCK_GROW();
+            blkptr = next_heap_block(blkptr);
+            UNLOCK_GROW();
+            break;
+        }
+        blkptr = NEXT_BLOCK(blkptr);
+    }
+    __atomic_store_n(&check_cursor, IS_WITHIN_HEAP(blkptr) ? blkptr : NULL, __ATOMIC_RELAXED);
+    UNLOCK_ARENA();
+    return ok;
+}
+
+/*
+ * check_payload - Checks the payload of an allocated block within the heap, holding the lock of its arena:
+ *     a slab object within the used part of its run, or a block together with its neighbours in the same
+ *     chunk. Returns 0 if inconsistent, printing why, and 1 otherwise.
+ */
+static int check_payload(void *ptr)
+{
+    char *blkptr = HEADER_ADDR(ptr), *prevblkptr, *run;
+    int cls, ok = 1;
+
+    if (IS_SLAB(ptr)) {
+        run = RUN_OF(ptr);
+        cls = RUN_CLASS(run);
+        if (cls < 0 || cls >= SLAB_CLASSES || RUN_NFREE(run) < 0 || RUN_NFREE(run) > RUN_CAPACITY(cls) ||
+                (char*)ptr < run + RUN_HEADER_SIZE || (char*)ptr >= run + RUN_BUMP(run) ||
+                ((char*)ptr - run - RUN_HEADER_SIZE) % SLAB_OBJ_SIZE(cls) != 0) {
+            printf("mm_check_step failed: slab object [%p] does not fit its run\n", ptr);
+            return 0;
+        }
+        return check_block(HEADER_ADDR(run));
+    } else if (!IS_SET(blkptr)) {
+        printf("mm_check_step failed: block [%p] returned is not allocated\n", blkptr);
+        return 0;
+    } else if (!check_block(blkptr))
+        return 0;
+
+    prevblkptr = blkptr - BLOCK_SIZE(blkptr - HEADER_SIZE); /* found by its footer if free */
+    if (!GET_PREV_ALLOC(blkptr) && !IS_BLOCK_ADDR(prevblkptr)) {
+        printf("mm_check_step failed: footer in front of block [%p] is out of heap\n", blkptr);
+        ok = 0;
+    } else if (!GET_PREV_ALLOC(blkptr))
+        ok = check_block(prevblkptr);
+    if (ok && !IS_EPILOGUE(NEXT_BLOCK(blkptr)))
+        ok = check_block(NEXT_BLOCK(blkptr));
+    return ok;
+}
+
+/*
+ * check_block - Checks a block of the heap: its size and alignment, the mark of its status in the next
+ *     header, and for a free block, its footer, its allocated neighbours and its links. Returns 0 if
+ *     inconsistent, printing why, and 1 otherwise.
+ */
+static int check_block(char *blkptr)
+{
+    word_t size = BLOCK_SIZE(blkptr);
+    char *nextblkptr = blkptr + size;
+    char *error = NULL;
+
+    if (size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 || nextblkptr > EPILOGUE_ADDR())
+        error = "has bad size";
+    else if (!GET_PREV_ALLOC(nextblkptr) != !IS_SET(blkptr))
+        error = "is marked wrong in next header";
+    else if (!IS_SET(blkptr) && (*(word_t*)(nextblkptr - HEADER_SIZE) != size || IS_GROWN(blkptr)))
+        error = "has bad footer";
+    else if (!IS_SET(blkptr) && (!GET_PREV_ALLOC(blkptr) || !IS_SET(nextblkptr)))
+        error = "is not coalesced";
+    else if (!IS_SET(blkptr) && !check_links(blkptr))
+        error = "has bad links";
+    if (error != NULL) {
+        printf("mm_check_step failed: block [%p] %s\n", blkptr, error);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * check_links - Checks that the list neighbours of a free block link back to it in size order, or that its
+ *     parent and children in a tree do in key order. Every link is checked to be a free block before it is
+ *     followed. Returns 0 if inconsistent, and 1 otherwise.
+ */
+static int check_links(char *blkptr)
+{
+    arena_t *saved = arena;
+    word_t size = BLOCK_SIZE(blkptr);
+    int index = size_class(size), ok = 1;
+    char *list, *link;
+
+    arena = ARENA_OF(blkptr);
+    list = LIST_HEADER(index);
+    if (!(arena->list_bitmap & (1u << index)))
+        ok = 0;
+    else if (IS_TREE_CLASS(index)) {
+        link = PARENT(blkptr);
+        if (link == NULL)
+            ok = TREE_ROOT(list) == blkptr && !IS_RED(blkptr);
+        else
+            ok = IS_BLOCK_ADDR(link) && !IS_SET(link) && ((LEFT(link) == blkptr && KEY_LESS(blkptr, link)) ||
+                (RIGHT(link) == blkptr && KEY_LESS(link, blkptr)));
+        if (ok && (link = LEFT(blkptr)) != NULL)
+            ok = IS_BLOCK_ADDR(link) && !IS_SET(link) && PARENT(link) == blkptr && KEY_LESS(link, blkptr) &&
+                !(IS_RED(blkptr) && IS_RED(link));
+        if (ok && (link = RIGHT(blkptr)) != NULL)
+            ok = IS_BLOCK_ADDR(link) && !IS_SET(link) && PARENT(link) == blkptr && KEY_LESS(blkptr, link) &&
+                !(IS_RED(blkptr) && IS_RED(link));
+    } else {
+        link = PREV_FREE_BLOCK(blkptr);
+        if (link == list)
+            ok = NEXT_FREE_BLOCK(list) == blkptr;
+        else
+            ok = IS_BLOCK_ADDR(link) && !IS_SET(link) && NEXT_FREE_BLOCK(link) == blkptr &&
+                BLOCK_SIZE(link) <= size && size_class(BLOCK_SIZE(link)) == index;
+        if (ok && !IS_END(blkptr)) {
+            link = NEXT_FREE_BLOCK(blkptr);
+            ok = IS_BLOCK_ADDR(link) && !IS_SET(link) && PREV_FREE_BLOCK(link) == blkptr &&
+                BLOCK_SIZE(link) >= size && size_class(BLOCK_SIZE(link)) == index;
+        } else if (ok) /* the last block must be the tail kept in the head */
+            ok = LIST_TAIL(list) == blkptr;
+    }
+    arena = saved;
+    return ok;
+}
+
+/*
+ * check_tree - Checks links, order, colors and size class of the subtree at node, whose keys must lie
+ *     strictly between lo and hi (NULL if unbounded). Returns its black height, or -1 if inconsistent.
+ */
+static int check_tree(char *node, char *parent, char *lo, char *hi, int index)
+{
+    int left, right;
+
+    if (node == NULL)
+        return 1;
+    if (IS_SET(node) || PARENT(node) != parent || size_class(BLOCK_SIZE(node)) != index ||
+        (lo != NULL && !KEY_LESS(lo, node)) || (hi != NULL && !KEY_LESS(node, hi)) ||
+        (IS_RED(node) && (IS_RED(LEFT(node)) || IS_RED(RIGHT(node)))))
+        return -1;
+    left = check_tree(LEFT(node), node, lo, node, index);
+    right = check_tree(RIGHT(node), node, node, hi, index);
+    if (left < 0 || left != right)
+        return -1;
+    return left + !IS_RED(node);
+}
+
+/*
+ * next_heap_block - Returns the block following given block in heap, skipping from the epilogue of a chunk
+ *     to the first block of the next one. Returns the final epilogue after the last block.
+ */
+static char *next_heap_block(char *blkptr)
+{
+    for (blkptr = NEXT_BLOCK(blkptr); IS_EPILOGUE(blkptr) && IS_WITHIN_HEAP(blkptr); blkptr += HEADER_SIZE) {
+        blkptr += HEADER_SIZE;
+        blkptr += ARENA_PAD(blkptr); /* the owner word of the next chunk */
+    }
+    return blkptr;
+}
@@ -3,7 +3,60 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern void *mm_malloc_usable(size_t size, size_t *usable);
+extern size_t mm_malloc_batch(size_t size, void **ptrs, size_t n);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void mm_lock_all(void);
+extern void mm_unlock_all(void);
+
+/*
+ * Heap telemetry filled in by mm_heap_stats. The event counts are
+ * totals since mm_init, and stay zero unless mm.c is built with
+ * MM_STATS; the heap shape is measured on every call.
+ */
+#define MM_STAT_CLASSES 32  /* segregated lists reported on */
+
+typedef struct {
+    /* event counts */
+    unsigned long mallocs;       /* requests served from ordinary blocks */
+    unsigned long lists_probed;  /* non-empty lists searched for a fit */
+    unsigned long search_hops;   /* free blocks and tree nodes visited searching */
+    unsigned long inserts;       /* free blocks inserted into lists ... */
+    unsigned long insert_hops;   /* ... and free blocks and tree nodes passed doing so */
+    unsigned long prev_lookups;  /* looks at the block in front of a block ... */
+    unsigned long prev_free;     /* ... that found it free */
+    unsigned long splits;        /* free blocks split to fit a request */
+    unsigned long coalesces;     /* free neighbours merged into a freed block */
+    unsigned long quick_hits;    /* requests served from a quick list */
+    unsigned long quick_flushes; /* batch passes coalescing the quick lists */
+    unsigned long sbrks;         /* calls growing or shrinking the heap ... */
+    unsigned long sbrk_bytes;    /* ... bytes the heap grew by ... */
+    unsigned long trim_bytes;    /* ... and bytes it shrank by */
+
+    /* heap shape */
+    size_t heap_size;            /* bytes of heap */
+    size_t free_bytes;           /* bytes in free blocks on lists ... */
+    size_t free_blocks;          /* ... how many free blocks there are ... */
+    size_t largest_free;         /* ... and the largest of them */
+    size_t quick_bytes;          /* bytes on quick lists, which count as allocated */
+    size_t class_blocks[MM_STAT_CLASSES]; /* free blocks on each segregated list ... */
+    size_t class_bytes[MM_STAT_CLASSES];  /* ... and their bytes */
+} mm_stats_t;
+
+extern void mm_heap_stats(mm_stats_t *stats);
+
+/*
+ * Checks a bounded slice of the heap, and the block of a payload just
+ * returned unless NULL; cheap enough to run after every request.
+ * Returns 0 if the heap is inconsistent, and 1 otherwise.
+ */
+extern int mm_check_step(void *ptr);
 
 
 /* 
@@ -0,0 +1,193 @@
+/*
+ * mmpreload.c - The malloc package as a drop-in replacement of libc malloc
+ *
+ * Build libmm.so and run a program with
+ *
+ *     LD_PRELOAD=./libmm.so program ...
+ *
+ * The library is built with MM_SYSTEM, so that memlib reserves the
+ * heap from the system with mmap instead of simulating it, with
+ * MM_THREADS, and with MM_PRELOAD, which turns on MMAP_THRESHOLD (see
+ * config.h). The heap is set up by the first request of any thread.
+ * Every entry point of the libc malloc family is exported, since a
+ * block allocated by libc must never reach mm_free; all of them set
+ * errno to ENOMEM when they fail. Blocks are aligned to ALIGNMENT
+ * bytes unless an aligned entry point asks for more. Requests of at
+ * least MMAP_THRESHOLD bytes get mappings of their own; an aligned
+ * request larger than MAX_HEAP fails. Forking takes every lock of the
+ * package first, so that the child finds the heap in a consistent
+ * state.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+#if !MM_SYSTEM || !MM_THREADS || !MM_PRELOAD
+#error "mmpreload.c requires MM_SYSTEM, MM_THREADS and MM_PRELOAD"
+#endif
+
+/* Only the entry points below are visible outside the library */
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static int heap_ready;            /* set once the heap is set up */
+
+static void heap_init(void);
+static int ready(void);
+static void *allocate(size_t size);
+static void *aligned(size_t align, size_t size);
+
+/*
+ * heap_init - Set up the heap and the fork handlers, exactly once
+ */
+static void heap_init(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+	return;
+    pthread_atfork(mm_lock_all, mm_unlock_all, mm_unlock_all);
+    __atomic_store_n(&heap_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ready - Return true if the heap is set up, setting it up if needed
+ */
+static int ready(void)
+{
+    if (!__atomic_load_n(&heap_ready, __ATOMIC_ACQUIRE))
+	pthread_once(&heap_once, heap_init);
+    return heap_ready;
+}
+
+/*
+ * aligned - Allocate size bytes aligned to align bytes, a power of two
+ */
+static void *aligned(size_t align, size_t size)
+{
+    void *ptr;
+
+    if (size == 0)
+	size = 1;
+    if (!ready() || (ptr = mm_memalign(align, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return ptr;
+}
+
+/*
+ * allocate - Allocate size bytes; malloc(0) returns a unique pointer,
+ *     as libc's does
+ */
+static void *allocate(size_t size)
+{
+    void *ptr;
+
+    if (size == 0)
+	size = 1;
+    if (!ready() || (ptr = mm_malloc(size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return allocate(size);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+EXPORT void free_sized(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+	mm_free_sized(ptr, size);
+}
+
+EXPORT void free_aligned_sized(void *ptr, size_t align, size_t size)
+{
+    if (ptr != NULL)
+	mm_free_sized(ptr, size);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (nmemb == 0 || size == 0)
+	return allocate(0);
+    if (!ready() || (ptr = mm_calloc(nmemb, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *newptr;
+
+    if (ptr == NULL)
+	return allocate(size);
+    else if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if ((newptr = mm_realloc(ptr, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return newptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((ptr = aligned(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return aligned(align, size);
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return aligned(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return aligned(page, (size <= MAX_HEAP) ? (size + page - 1) & ~(page - 1) : size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}
@@ -0,0 +1,410 @@
+/*
+ * mmtrace.c - A recorder of the malloc requests of a live process
+ *
+ * Build libmmtrace.so and run a program with
+ *
+ *     LD_PRELOAD=./libmmtrace.so MMTRACE=<prefix> program ...
+ *
+ * Every malloc, calloc, realloc and free of the program is passed on
+ * to libc, and recorded in the event log <prefix>.<pid>.<n> of the
+ * thread that made it (see trace.h). Merge the logs into a trace with
+ * mergetrace. The default prefix is "mmtrace".
+ *
+ * Each thread buffers its events, and writes them out with a single
+ * write when the buffer is full or the thread exits; threads still
+ * running when the process exits lose the events they buffered. The
+ * only state the threads share is the table from live pointers to
+ * block ids, an open addressing hash table whose slots are claimed
+ * with compare-and-swap, and two counters that hand out ids and
+ * sequence numbers. Requests made through other entry points, such
+ * as posix_memalign, are not recorded, and neither are their frees.
+ *
+ * A child process the program forks records a trace of its own, in
+ * logs named by its pid: its thread drops the events it inherited
+ * buffered, which its parent writes out, and starts with an empty
+ * table and counters. The blocks it inherited are not in the table,
+ * so their frees are not recorded, and a realloc of one of them is
+ * recorded as a new block.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define EVENT_BUFFER  4096         /* events a thread buffers before writing */
+#define TABLE_SHIFT   22           /* log2 of the slots of the pointer table */
+#define TABLE_SLOTS   (1 << TABLE_SHIFT)
+#define TOMBSTONE     ((void *)1)  /* key of a slot whose pointer was freed */
+#define BOOTSTRAP     (1 << 16)    /* bytes handed out before libc is found */
+#define MAXLINE       1024         /* max string size */
+
+/* Maps a live pointer to the id of its block */
+typedef struct {
+    void *key;    /* the pointer, NULL if never used, or TOMBSTONE */
+    int32_t id;   /* the id of its block */
+} slot_t;
+
+/* Holds the event log of one thread */
+typedef struct {
+    int fd;                 /* log file, or -1 until the first event */
+    int count;              /* events in the buffer */
+    int busy;               /* set while the recorder itself runs */
+    trace_event_t *events;  /* the buffer */
+} tlog_t;
+
+/* The functions of libc */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static slot_t *table;             /* from live pointers to block ids */
+static uint32_t next_id;          /* id of the next new block */
+static uint64_t next_seq;         /* sequence number of the next event */
+static uint32_t next_log;         /* number of the next thread log */
+static int full_warned;           /* set once the table has filled up */
+static int resolving;             /* set while looking up libc */
+static pthread_key_t log_key;     /* writes out the log of a thread on exit */
+
+static __thread tlog_t tlog = {-1, 0, 0, NULL};
+
+/* dlsym may allocate before real_calloc is known; that comes from here */
+static char bootstrap[BOOTSTRAP];
+static size_t bootstrap_used;
+
+#define IS_BOOTSTRAP(ptr) ((char *)(ptr) >= bootstrap && (char *)(ptr) < bootstrap + BOOTSTRAP)
+
+static void init(void);
+static void *bootstrap_alloc(size_t size);
+static void table_insert(void *ptr, int32_t id);
+static int32_t table_remove(void *ptr);
+static void record(int type, int32_t id, size_t size);
+static void flush_log(tlog_t *log);
+static void release_log(void *arg);
+static void fork_child(void);
+
+
+
+/*********************
+ * Wrapped Functions *
+ *********************/
+
+void *malloc(size_t size)
+{
+    void *ptr;
+    int32_t id;
+
+    if (real_malloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        init();
+    }
+    ptr = real_malloc(size);
+    if (ptr != NULL && !tlog.busy) {
+        tlog.busy = 1;
+        id = (int32_t)__atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        table_insert(ptr, id);
+        record(ALLOC, id, size);
+        tlog.busy = 0;
+    }
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+    int32_t id;
+
+    if (real_calloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(nmemb * size); /* static, so already zero */
+        init();
+    }
+    ptr = real_calloc(nmemb, size);
+    if (ptr != NULL && !tlog.busy) {
+        tlog.busy = 1;
+        id = (int32_t)__atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        table_insert(ptr, id);
+        record(ALLOC, id, nmemb * size);
+        tlog.busy = 0;
+    }
+    return ptr;
+}
+
+/*
+ * realloc - The old pointer leaves the table before libc sees it: once libc
+ *     has freed it, another thread may get it back and insert it again.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    void *newptr;
+    int32_t id;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (IS_BOOTSTRAP(ptr)) {
+        if ((newptr = malloc(size)) != NULL)
+            memcpy(newptr, ptr, size < (size_t)(bootstrap + BOOTSTRAP - (char *)ptr) ?
+                   size : (size_t)(bootstrap + BOOTSTRAP - (char *)ptr));
+        return newptr;
+    }
+    if (real_realloc == NULL)
+        init();
+    if (tlog.busy)
+        return real_realloc(ptr, size);
+
+    tlog.busy = 1;
+    id = table_remove(ptr);
+    if ((newptr = real_realloc(ptr, size)) == NULL) {
+        if (id >= 0)
+            table_insert(ptr, id); /* the old block is still there */
+    }
+    else if (id >= 0) {
+        table_insert(newptr, id);
+        record(REALLOC, id, size);
+    }
+    else { /* the block was not malloc'ed through us; record it from now on */
+        id = (int32_t)__atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        table_insert(newptr, id);
+        record(ALLOC, id, size);
+    }
+    tlog.busy = 0;
+    return newptr;
+}
+
+/*
+ * free - The pointer leaves the table, and its event gets its sequence
+ *     number, before libc can hand it to another thread.
+ */
+void free(void *ptr)
+{
+    int32_t id;
+
+    if (ptr == NULL || IS_BOOTSTRAP(ptr))
+        return;
+    if (real_free == NULL)
+        init();
+    if (real_free == NULL)
+        return; /* freed by dlsym in init; leak it */
+    if (!tlog.busy) {
+        tlog.busy = 1;
+        if ((id = table_remove(ptr)) >= 0)
+            record(FREE, id, 0);
+        tlog.busy = 0;
+    }
+    real_free(ptr);
+}
+
+
+
+/**********************
+ * Recorder Functions *
+ **********************/
+
+/*
+ * init - Map the pointer table, and look up the functions of libc. It runs as a constructor, before the
+ *     program can start threads, unless an earlier constructor allocates first.
+ */
+static void __attribute__((constructor)) init(void)
+{
+    if (table != NULL)
+        return;
+
+    /* untouched pages of the table cost nothing */
+    table = mmap(NULL, TABLE_SLOTS * sizeof(slot_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        fprintf(stderr, "mmtrace: cannot map the pointer table\n");
+        abort();
+    }
+    pthread_key_create(&log_key, release_log);
+    pthread_atfork(NULL, NULL, fork_child);
+
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = 0;
+    if (real_malloc == NULL || real_calloc == NULL || real_realloc == NULL || real_free == NULL) {
+        fprintf(stderr, "mmtrace: cannot find the malloc functions of libc\n");
+        abort();
+    }
+}
+
+/*
+ * bootstrap_alloc - Hand out static memory while dlsym runs in init
+ */
+static void *bootstrap_alloc(size_t size)
+{
+    void *ptr = bootstrap + bootstrap_used;
+
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > BOOTSTRAP)
+        return NULL;
+    bootstrap_used += size;
+    return ptr;
+}
+
+/*
+ * table_insert - Map a pointer to a block id. Probing starts at the hash of the pointer and takes the first
+ *     slot that is unused or whose pointer was freed. A live pointer is in the table at most once, so no
+ *     slot further on can hold it.
+ */
+static void table_insert(void *ptr, int32_t id)
+{
+    uint32_t i, start = (uint32_t)(((uintptr_t)ptr >> 4) * 2654435761u) & (TABLE_SLOTS - 1);
+    void *key;
+
+    for (i = start; ; ) {
+        key = __atomic_load_n(&table[i].key, __ATOMIC_RELAXED);
+        if ((key == NULL || key == TOMBSTONE) &&
+            __atomic_compare_exchange_n(&table[i].key, &key, ptr, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&table[i].id, id, __ATOMIC_RELEASE);
+            return;
+        }
+        if ((i = (i + 1) & (TABLE_SLOTS - 1)) == start)
+            break;
+    }
+    if (!__atomic_exchange_n(&full_warned, 1, __ATOMIC_RELAXED))
+        fprintf(stderr, "mmtrace: pointer table is full; the trace will be incomplete\n");
+}
+
+/*
+ * table_remove - Returns the block id of a pointer and forgets it, or -1 if the pointer is not in the table.
+ *     Only the thread that frees a pointer removes it, so the slot cannot change under it.
+ */
+static int32_t table_remove(void *ptr)
+{
+    uint32_t i, start = (uint32_t)(((uintptr_t)ptr >> 4) * 2654435761u) & (TABLE_SLOTS - 1);
+    void *key;
+    int32_t id;
+
+    for (i = start; ; ) {
+        key = __atomic_load_n(&table[i].key, __ATOMIC_ACQUIRE);
+        if (key == NULL)
+            return -1;
+        if (key == ptr) {
+            id = __atomic_load_n(&table[i].id, __ATOMIC_ACQUIRE);
+            __atomic_store_n(&table[i].key, TOMBSTONE, __ATOMIC_RELEASE);
+            return id;
+        }
+        if ((i = (i + 1) & (TABLE_SLOTS - 1)) == start)
+            return -1;
+    }
+}
+
+/*
+ * record - Add an event to the log of the calling thread, which is opened on its first event
+ */
+static void record(int type, int32_t id, size_t size)
+{
+    char path[MAXLINE];
+    char *prefix;
+    trace_event_t *event;
+
+    if (tlog.fd < 0) {
+        if ((prefix = getenv("MMTRACE")) == NULL)
+            prefix = "mmtrace";
+        snprintf(path, MAXLINE, "%s.%d.%u", prefix, (int)getpid(),
+                 __atomic_fetch_add(&next_log, 1, __ATOMIC_RELAXED));
+        tlog.events = mmap(NULL, EVENT_BUFFER * sizeof(trace_event_t), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tlog.events == MAP_FAILED ||
+            (tlog.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            fprintf(stderr, "mmtrace: cannot create %s\n", path);
+            abort();
+        }
+        if (write(tlog.fd, TRACE_LOG_MAGIC, 4) != 4)
+            fprintf(stderr, "mmtrace: cannot write %s\n", path);
+        pthread_setspecific(log_key, &tlog);
+    }
+
+    event = &tlog.events[tlog.count++];
+    event->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    event->op.type = type;
+    event->op.index = id;
+    event->op.size = (size > 0) ? (int)size : 1; /* a malloc(0) pointer can still be freed */
+    if (tlog.count == EVENT_BUFFER)
+        flush_log(&tlog);
+}
+
+/*
+ * flush_log - Write out the buffered events of a thread log
+ */
+static void flush_log(tlog_t *log)
+{
+    char *buf = (char *)log->events;
+    size_t left = log->count * sizeof(trace_event_t);
+    ssize_t n;
+
+    while (left > 0) {
+        if ((n = write(log->fd, buf, left)) <= 0) {
+            fprintf(stderr, "mmtrace: cannot write an event log\n");
+            break;
+        }
+        buf += n;
+        left -= n;
+    }
+    log->count = 0;
+}
+
+/*
+ * release_log - Write out and close the log of an exiting thread
+ */
+static void release_log(void *arg)
+{
+    tlog_t *log = (tlog_t *)arg;
+
+    log->busy = 1; /* the thread records nothing more */
+    flush_log(log);
+    close(log->fd);
+    munmap(log->events, EVENT_BUFFER * sizeof(trace_event_t));
+    log->fd = -1;
+}
+
+/*
+ * finish - Write out the log of the thread that exits the process
+ */
+static void __attribute__((destructor)) finish(void)
+{
+    if (tlog.fd >= 0)
+        release_log(&tlog);
+}
+
+/*
+ * fork_child - Start the trace of a child process afresh. The parent writes out the events its forking
+ *     thread had buffered, so the child drops them, and opens a log of its own on its first event. The
+ *     table is mapped again over the old one, which leaves it empty without touching its pages.
+ */
+static void fork_child(void)
+{
+    if (tlog.fd >= 0) {
+        close(tlog.fd);
+        munmap(tlog.events, EVENT_BUFFER * sizeof(trace_event_t));
+        tlog.fd = -1;
+        tlog.count = 0;
+        tlog.events = NULL;
+        pthread_setspecific(log_key, NULL);
+    }
+    if (mmap(table, TABLE_SLOTS * sizeof(slot_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        fprintf(stderr, "mmtrace: cannot map the pointer table\n");
+        abort();
+    }
+    next_id = 0;
+    next_seq = 0;
+    next_log = 0;
+    full_warned = 0;
+}
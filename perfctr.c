@@ -0,0 +1,147 @@
+/*
+ * perfctr.c - Count the hardware events of a function f
+ *
+ * Uses perf_event_open on Linux to count the cycles, instructions and
+ * cache, TLB and branch misses of one run of f, in user mode and on the
+ * calling thread only. Each event has a counter of its own, so one the
+ * CPU or a virtual machine lacks does not keep the others from being
+ * counted; if the kernel has to multiplex them, the counts are scaled
+ * by the share of the run they were running.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Short names of the events, in the order of PERF_CYCLES on */
+char *perf_event_names[PERF_EVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses",
+    "dtlb_misses", "branch_misses"
+};
+
+#ifdef __linux__
+
+/* The cache events count read misses of the given cache */
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* The type and config of each event, in the order of PERF_CYCLES on */
+static struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+/* The value of a counter, as read with the times it was enabled and running */
+typedef struct {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+} reading_t;
+
+static int fds[PERF_EVENTS] = {-1, -1, -1, -1, -1, -1}; /* -1 if not opened */
+
+/*
+ * init_perf - Open a disabled counter of each event for the calling
+ *     thread, and return how many of them could be opened
+ */
+int init_perf(void)
+{
+    struct perf_event_attr attr;
+    int i, opened = 0, error = 0;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    opened++;
+	    continue;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    opened++;
+	else if (error == 0)
+	    error = errno;
+    }
+    errno = error;
+    return opened;
+}
+
+/*
+ * fperf - Count the events of one run of f(argp) in *counts. Events
+ *     whose counter could not be opened, or never got to run, are -1.
+ */
+void fperf(perf_test_funct f, void *argp, perf_counts_t *counts)
+{
+    reading_t reading;
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+    f(argp);
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	counts->count[i] = -1;
+	if (fds[i] < 0 ||
+	    read(fds[i], &reading, sizeof(reading)) != sizeof(reading) ||
+	    reading.time_running == 0)
+	    continue;
+	counts->count[i] = (double)reading.value;
+	if (reading.time_running < reading.time_enabled)
+	    counts->count[i] *= (double)reading.time_enabled / reading.time_running;
+    }
+}
+
+#else /* !__linux__ */
+
+/*
+ * init_perf - There is no perf_event_open to count events with
+ */
+int init_perf(void)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+/*
+ * fperf - Run f(argp), with none of its events counted
+ */
+void fperf(perf_test_funct f, void *argp, perf_counts_t *counts)
+{
+    int i;
+
+    f(argp);
+    for (i = 0; i < PERF_EVENTS; i++)
+	counts->count[i] = -1;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,35 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count the
+ *     hardware events of a test function f with perf_event_open
+ */
+
+/* The events counted, in the order of the counts of a perf_counts_t */
+#define PERF_CYCLES        0  /* CPU cycles */
+#define PERF_INSTRUCTIONS  1  /* instructions retired */
+#define PERF_L1D_MISSES    2  /* L1 data cache read misses */
+#define PERF_LLC_MISSES    3  /* last level cache read misses */
+#define PERF_DTLB_MISSES   4  /* data TLB read misses */
+#define PERF_BRANCH_MISSES 5  /* mispredicted branches */
+#define PERF_EVENTS        6
+
+/* Holds the events counted over one run of a test function */
+typedef struct {
+    double count[PERF_EVENTS]; /* scaled if multiplexed; -1 if not counted */
+} perf_counts_t;
+
+/* The test function takes a generic pointer as input */
+typedef void (*perf_test_funct)(void *);
+
+/* The short names of the events, for column titles and reports */
+extern char *perf_event_names[PERF_EVENTS];
+
+/*
+ * init_perf - Open a counter of each event for the calling thread, and
+ *     return how many of them could be opened (0 if none, or on systems
+ *     without perf_event_open). The error of the first event that could
+ *     not be opened is left in errno.
+ */
+int init_perf(void);
+
+/* Count the events of one run of f(argp) in *counts */
+void fperf(perf_test_funct f, void *argp, perf_counts_t *counts);
@@ -0,0 +1,107 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) into a binary trace
+ *
+ * Usage: rep2bin <in.rep> <out>
+ *
+ * Requests are read and written one at a time, so traces of any length
+ * can be converted. Block ids are renumbered on the way, to the lowest
+ * id that is not held by a live block (see trace.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t header;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size, num_ids, ops = 0;
+    int *newid;     /* new id of every live old id, -1 if none */
+    int *freeids;   /* new ids that are not in use, as a stack... */
+    int nfree = 0;  /* ... of that many ids */
+    int next = 0;   /* lowest new id never used so far */
+    unsigned i;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	app_error("Could not open input trace");
+    if ((out = fopen(argv[2], "wb")) == NULL)
+	app_error("Could not open output trace");
+
+    /* the header is written again once the new number of ids is known */
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    if (fscanf(in, "%d %u %d %d", &header.sugg_heapsize, &num_ids,
+	       &header.num_ops, &header.weight) != 4)
+	app_error("Bad trace header");
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+	app_error("Write error");
+
+    if ((newid = (int *)malloc(num_ids * sizeof(int))) == NULL ||
+	(freeids = (int *)malloc(num_ids * sizeof(int))) == NULL)
+	app_error("Out of memory");
+    for (i = 0; i < num_ids; i++)
+	newid[i] = -1;
+
+    while (fscanf(in, "%s", type) != EOF) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2 || index >= num_ids)
+		app_error("Bad alloc or realloc request");
+	    op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    op.size = size;
+	    if (newid[index] < 0) /* a realloc may also start a block */
+		newid[index] = (nfree > 0) ? freeids[--nfree] : next++;
+	    op.index = newid[index];
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1 || index >= num_ids || newid[index] < 0)
+		app_error("Bad free request");
+	    op.type = FREE;
+	    op.size = 0;
+	    op.index = newid[index];
+	    freeids[nfree++] = newid[index];
+	    newid[index] = -1;
+	    break;
+	default:
+	    app_error("Bogus type character in trace");
+	}
+	if (fwrite(&op, sizeof(op), 1, out) != 1)
+	    app_error("Write error");
+	ops++;
+    }
+    if (ops != header.num_ops)
+	app_error("Number of requests does not match the header");
+
+    header.num_ids = next;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+	app_error("Write error");
+    if (fclose(out) != 0)
+	app_error("Write error");
+    fclose(in);
+    free(newid);
+    free(freeids);
+    printf("%s: %u requests, %u ids reduced to %d\n", argv[2], ops, num_ids, next);
+    exit(0);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "rep2bin: %s\n", msg);
+    exit(1);
+}
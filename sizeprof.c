@@ -0,0 +1,245 @@
+/*
+ * sizeprof.c - Profile the block sizes of traces, and generate the size
+ *              classes of the segregated lists of mm.c from them
+ *
+ * Usage: sizeprof [-c <n>] [-w <n>] [-o <file>] <trace>...
+ *
+ * Every trace is a .rep file, a binary trace, or an event log written by
+ * mmtrace (see trace.h). Each malloc and realloc request is turned into
+ * the block size mm.c carves for it, with headers of -w bytes (4 unless
+ * given), and counted. Block sizes below SIZE_CLASS_MAX are then split
+ * into -c classes (LIST_TOTAL - POW2_CLASSES unless given). The sizes
+ * requested most each start a class, so that every free block on the
+ * list a request of such a size searches first fits it; classes left
+ * over split the classes spanning the largest ratio of sizes in two.
+ * Larger sizes keep one class per power of two.
+ *
+ * The header is written to -o, or on stdout; build mm.c with it using
+ *
+ *     make CFLAGS='... -DSIZE_CLASSES=\"sizeclass.h\"'
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXLINE        1024      /* max string size */
+#define LIST_TOTAL     32        /* segregated lists of mm.c */
+#define POW2_CLASSES   12        /* default lists kept for sizes of SIZE_CLASS_MAX on */
+#define SIZE_CLASS_MAX (1 << 12) /* block sizes classed by the table, MALLOCBUF of mm.c */
+#define ALIGNMENT      8
+#define GRANULES       (SIZE_CLASS_MAX / ALIGNMENT)
+#define LOWEST(g)      ((g) > 4 * header_size / ALIGNMENT ? (g) : 4 * header_size / ALIGNMENT)
+                                 /* smallest block size, in granules, of a class from g */
+
+static unsigned long counts[GRANULES]; /* requests of each block size below SIZE_CLASS_MAX */
+static unsigned long large;            /* requests of larger blocks */
+static int header_size = 4;            /* bytes of a block header (-w) */
+
+static void read_trace(char *name);
+static void count_request(traceop_t *op);
+static unsigned long block_size(unsigned long size);
+static int pow2_ceil(unsigned long size);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    int classes = LIST_TOTAL - POW2_CLASSES;
+    int bound[GRANULES + 1]; /* first granule of every class, and GRANULES */
+    char start[GRANULES];    /* set if a granule starts a class */
+    unsigned long sum;
+    int c, i, k, nbounds, best, widest;
+    char *outname = NULL;    /* file the header goes to (-o); stdout if NULL */
+    FILE *out = stdout;
+
+    while ((c = getopt(argc, argv, "c:w:o:")) != EOF) {
+	switch (c) {
+	case 'c':
+	    classes = atoi(optarg);
+	    break;
+	case 'w':
+	    header_size = atoi(optarg);
+	    break;
+	case 'o':
+	    outname = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind >= argc || classes < 2 || classes >= LIST_TOTAL ||
+	(header_size != 4 && header_size != 8))
+	usage();
+    for (i = optind; i < argc; i++)
+	read_trace(argv[i]);
+
+    /* the sizes requested most start classes of their own */
+    for (i = 0; i < GRANULES; i++)
+	start[i] = (i == 0);
+    for (nbounds = 1; nbounds < classes; nbounds++) {
+	for (best = -1, i = 1; i < GRANULES; i++)
+	    if (!start[i] && counts[i] != 0 && (best < 0 || counts[i] > counts[best]))
+		best = i;
+	if (best < 0)
+	    break;
+	start[best] = 1;
+    }
+    for (i = 0, k = 0; i < GRANULES; i++)
+	if (start[i])
+	    bound[k++] = i;
+    bound[nbounds] = GRANULES;
+
+    /* split the classes spanning the largest ratio of block sizes until there are enough */
+    while (nbounds < classes) {
+	for (widest = -1, k = 0; k < nbounds; k++)
+	    if (bound[k + 1] - LOWEST(bound[k]) > 1 &&
+		(widest < 0 || (double)bound[k + 1] / LOWEST(bound[k]) >
+		 (double)bound[widest + 1] / LOWEST(bound[widest])))
+		widest = k;
+	if (widest < 0)
+	    break;
+	memmove(bound + widest + 2, bound + widest + 1, (nbounds - widest) * sizeof(int));
+	bound[widest + 1] = LOWEST(bound[widest]) + (bound[widest + 2] - LOWEST(bound[widest])) / 2;
+	nbounds++;
+    }
+
+    if (outname != NULL && (out = fopen(outname, "w")) == NULL)
+	app_error("Could not open the output file");
+    fprintf(out, "/*\n * Size classes generated by sizeprof -c %d -w %d from\n", nbounds, header_size);
+    for (i = optind; i < argc; i++)
+	fprintf(out, " *     %s\n", argv[i]);
+    for (i = 0, sum = 0; i < GRANULES; i++)
+	sum += counts[i];
+    fprintf(out, " * %lu requests of blocks below %d bytes, and %lu larger.\n",
+	    sum, SIZE_CLASS_MAX, large);
+    fprintf(out, " *\n *  list       block sizes      requests\n");
+    for (k = 0; k < nbounds; k++) {
+	for (i = bound[k], sum = 0; i < bound[k + 1]; i++)
+	    sum += counts[i];
+	fprintf(out, " *  %4d  %6d - %-6d  %10lu\n", k, bound[k] * ALIGNMENT,
+		bound[k + 1] * ALIGNMENT - 1, sum);
+    }
+    fprintf(out, " */\n");
+    fprintf(out, "#define SIZE_CLASS_MAX   %d  /* block sizes below are classed by the table */\n", SIZE_CLASS_MAX);
+    fprintf(out, "#define SIZE_CLASS_SMALL %d    /* lists of the table; one per power of two follows */\n", nbounds);
+    fprintf(out, "#define TREE_CLASS       SIZE_CLASS_SMALL\n");
+    fprintf(out, "#if WORD_SIZE != %d\n#error \"%s was generated for %d-byte headers\"\n#endif\n",
+	    header_size, outname != NULL ? outname : "this header", header_size);
+    fprintf(out, "static const uint8_t size_class_table[SIZE_CLASS_MAX / ALIGNMENT] = {");
+    for (i = 0, k = 0; i < GRANULES; i++) {
+	while (i >= bound[k + 1])
+	    k++;
+	fprintf(out, "%s%2d,", (i % 16 == 0) ? "\n    " : " ", k);
+    }
+    fprintf(out, "\n};\n");
+    if (out != stdout && fclose(out) != 0)
+	app_error("Could not write the output file");
+    exit(0);
+}
+
+/*
+ * read_trace - Count the requests of a .rep file, binary trace or event log
+ */
+static void read_trace(char *name)
+{
+    FILE *fp;
+    trace_header_t header;
+    trace_event_t event;
+    traceop_t op;
+    char type[MAXLINE];
+    int sugg_heapsize, num_ids, num_ops, weight, i;
+    unsigned index, size;
+
+    if ((fp = fopen(name, "rb")) == NULL)
+	app_error("Could not open a trace");
+    if (fread(type, 4, 1, fp) == 1 && !memcmp(type, TRACE_MAGIC, 4)) {
+	rewind(fp);
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.version != TRACE_VERSION)
+	    app_error("Bad binary trace header");
+	for (i = 0; i < header.num_ops; i++) {
+	    if (fread(&op, sizeof(op), 1, fp) != 1)
+		app_error("Binary trace is too short");
+	    count_request(&op);
+	}
+    } else if (!memcmp(type, TRACE_LOG_MAGIC, 4)) {
+	while (fread(&event, sizeof(event), 1, fp) == 1)
+	    count_request(&event.op);
+    } else {
+	rewind(fp);
+	if (fscanf(fp, "%d %d %d %d", &sugg_heapsize, &num_ids, &num_ops, &weight) != 4)
+	    app_error("Bad trace header");
+	while (fscanf(fp, "%s", type) != EOF) {
+	    if ((type[0] == 'a' || type[0] == 'r') && fscanf(fp, "%u %u", &index, &size) == 2) {
+		op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+		op.size = size;
+	    } else if (type[0] == 'f' && fscanf(fp, "%u", &index) == 1) {
+		op.type = FREE;
+		op.size = 0;
+	    } else
+		app_error("Bad request in trace");
+	    op.index = index;
+	    count_request(&op);
+	}
+    }
+    fclose(fp);
+}
+
+/*
+ * count_request - Count the block a malloc or realloc request gets
+ */
+static void count_request(traceop_t *op)
+{
+    unsigned long block;
+
+    if (op->type == FREE)
+	return;
+    else if (op->size < 0)
+	app_error("Bad request size in trace");
+    if ((block = block_size(op->size)) < SIZE_CLASS_MAX)
+	counts[block / ALIGNMENT]++;
+    else
+	large++;
+}
+
+/*
+ * block_size - Returns the size of the block mm.c carves for a request:
+ *     requests below MALLOCBUF are rounded up to a power of two, and then
+ *     a header is added and the sum aligned, to at least four headers
+ */
+static unsigned long block_size(unsigned long size)
+{
+    if (size < SIZE_CLASS_MAX)
+	size = 1ul << pow2_ceil(size);
+    if (size <= 3 * (unsigned long)header_size)
+	return 4 * header_size;
+    return (size + header_size + ALIGNMENT - 1) & ~(unsigned long)(ALIGNMENT - 1);
+}
+
+/*
+ * pow2_ceil - Returns the log2 of the smallest power of two not below size
+ */
+static int pow2_ceil(unsigned long size)
+{
+    return (size <= 1) ? 0 : 64 - __builtin_clzll((unsigned long long)size - 1);
+}
+
+/*
+ * usage - Print the command line and exit
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: sizeprof [-c <n>] [-w <n>] [-o <file>] <trace>...\n");
+    exit(1);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "sizeprof: %s\n", msg);
+    exit(1);
+}
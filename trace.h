@@ -0,0 +1,51 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - Trace requests, and the binary trace format
+ *
+ * A binary trace is a trace_header_t followed by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it. The driver
+ * maps the records into memory and replays them in place, so neither
+ * its startup time nor its memory grow with the length of the trace.
+ * Block ids are renumbered so that an id is reused once its block is
+ * freed, which bounds num_ids by the most blocks live at once. Binary
+ * traces are written from .rep files by rep2bin.
+ *
+ * The recorder library (mmtrace.c) writes one event log per thread of a
+ * live process: TRACE_LOG_MAGIC followed by trace_event_t records. Their
+ * requests carry ids that are never reused, and their sequence numbers
+ * order them across threads. mergetrace merges the logs of a process
+ * into one .rep or binary trace.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC   "MMTR" /* first bytes of a binary trace */
+#define TRACE_VERSION 1      /* format of the records that follow */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Heads a binary trace file */
+typedef struct {
+    char magic[4];          /* TRACE_MAGIC */
+    int32_t version;        /* TRACE_VERSION */
+    int32_t sugg_heapsize;  /* suggested heap size (unused) */
+    int32_t num_ids;        /* number of alloc/realloc ids */
+    int32_t num_ops;        /* number of requests that follow */
+    int32_t weight;         /* weight for this trace (unused) */
+} trace_header_t;
+
+#define TRACE_LOG_MAGIC "MMTL" /* first bytes of a thread's event log */
+
+/* Records one request in an event log */
+typedef struct {
+    uint64_t seq;  /* position of the request among those of all threads */
+    traceop_t op;  /* the request */
+} trace_event_t;
+
+#endif /* __TRACE_H_ */